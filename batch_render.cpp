@@ -0,0 +1,224 @@
+
+/*******************************************************************************
+*  The "New BSD License" : http://www.opensource.org/licenses/bsd-license.php  *
+********************************************************************************
+
+Copyright (c) 2010, Mark Turney
+All rights reserved.
+
+Redistribution and use in source and binary forms, with or without
+modification, are permitted provided that the following conditions are met:
+	* Redistributions of source code must retain the above copyright
+	  notice, this list of conditions and the following disclaimer.
+	* Redistributions in binary form must reproduce the above copyright
+	  notice, this list of conditions and the following disclaimer in the
+	  documentation and/or other materials provided with the distribution.
+	* Neither the name of the <organization> nor the
+	  names of its contributors may be used to endorse or promote products
+	  derived from this software without specific prior written permission.
+
+THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS "AS IS" AND
+ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE IMPLIED
+WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE ARE
+DISCLAIMED. IN NO EVENT SHALL <COPYRIGHT HOLDER> BE LIABLE FOR ANY
+DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR CONSEQUENTIAL DAMAGES
+(INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS OR SERVICES;
+LOSS OF USE, DATA, OR PROFITS; OR BUSINESS INTERRUPTION) HOWEVER CAUSED AND
+ON ANY THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT LIABILITY, OR TORT
+(INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY OUT OF THE USE OF THIS
+SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF SUCH DAMAGE.
+
+******************************************************************************/
+#include "batch_render.hpp"
+
+#include <algorithm>
+#include <atomic>
+#include <chrono>
+#include <condition_variable>
+#include <deque>
+#include <mutex>
+#include <thread>
+
+namespace svg {
+
+namespace {
+
+// Job indices dealt to one worker.  The owner takes from the front and
+// thieves from the back, so they only meet on the last job.
+struct JobQueue
+{
+	std::mutex mutex;
+	std::deque<size_t> jobs;
+};
+
+class JobQueues
+{
+public:
+	JobQueues(size_t job_count, unsigned worker_count)
+	{
+		for (unsigned w = 0; w < worker_count; ++w) {
+			queues.push_back(std::unique_ptr<JobQueue>(new JobQueue));
+		}
+		// Round-robin, so neighbouring jobs, which tend to cost about the
+		// same, are spread over all workers.
+		for (size_t i = 0; i < job_count; ++i) {
+			queues[i % worker_count]->jobs.push_back(i);
+		}
+	}
+
+	// Returns false once every queue is empty; no jobs are added later.
+	bool take(unsigned worker, size_t& job, size_t& steals)
+	{
+		{
+			JobQueue& own = *queues[worker];
+			std::lock_guard<std::mutex> lock(own.mutex);
+			if (!own.jobs.empty()) {
+				job = own.jobs.front();
+				own.jobs.pop_front();
+				return true;
+			}
+		}
+		for (size_t k = 1; k < queues.size(); ++k) {
+			JobQueue& victim = *queues[(worker + k) % queues.size()];
+			std::lock_guard<std::mutex> lock(victim.mutex);
+			if (!victim.jobs.empty()) {
+				job = victim.jobs.back();
+				victim.jobs.pop_back();
+				++steals;
+				return true;
+			}
+		}
+		return false;
+	}
+
+private:
+	vector<std::unique_ptr<JobQueue>> queues;
+};
+
+// Bounded hand-off of finished documents to the writer thread.
+class WriteQueue
+{
+public:
+	explicit WriteQueue(size_t capacity) : capacity(std::max<size_t>(capacity, 1)), closed(false) { }
+
+	void push(std::unique_ptr<Document> doc)
+	{
+		std::unique_lock<std::mutex> lock(mutex);
+		not_full.wait(lock, [this] { return documents.size() < capacity; });
+		documents.push_back(std::move(doc));
+		not_empty.notify_one();
+	}
+
+	// Returns false once the queue is closed and drained.
+	bool pop(std::unique_ptr<Document>& doc)
+	{
+		std::unique_lock<std::mutex> lock(mutex);
+		not_empty.wait(lock, [this] { return closed || !documents.empty(); });
+		if (documents.empty()) {
+			return false;
+		}
+		doc = std::move(documents.front());
+		documents.pop_front();
+		not_full.notify_one();
+		return true;
+	}
+
+	void close()
+	{
+		std::lock_guard<std::mutex> lock(mutex);
+		closed = true;
+		not_empty.notify_all();
+	}
+
+private:
+	std::mutex mutex;
+	std::condition_variable not_empty;
+	std::condition_variable not_full;
+	std::deque<std::unique_ptr<Document>> documents;
+	size_t capacity;
+	bool closed;
+};
+
+void renderJobs(const vector<DocumentJob>& jobs, JobQueues& queues, WriteQueue& writes,
+	BatchWorker& worker, std::atomic<size_t>& failed, std::atomic<size_t>& steals)
+{
+	size_t job_index;
+	size_t stolen = 0;
+	while (queues.take(worker.index, job_index, stolen)) {
+		const DocumentJob& job = jobs[job_index];
+		std::unique_ptr<Document> doc(new Document(job.file_name, job.layout, worker.blocks));
+		worker.scratch.clear();
+		doc->pending.swap(worker.scratch);
+		try {
+			job.build(*doc, worker);
+		} catch (...) {
+			doc->pending.swap(worker.scratch);
+			++failed;
+			continue;
+		}
+		// Leave the document only pooled blocks and take the scratch string
+		// back for the next one.
+		doc->flush();
+		doc->pending.swap(worker.scratch);
+		writes.push(std::move(doc));
+	}
+	steals += stolen;
+}
+
+void writeDocuments(WriteQueue& writes, std::atomic<size_t>& saved, std::atomic<size_t>& failed)
+{
+	std::unique_ptr<Document> doc;
+	while (writes.pop(doc)) {
+		if (doc->save()) {
+			++saved;
+		} else {
+			++failed;
+		}
+		doc.reset();
+	}
+}
+
+} // namespace
+
+BatchStats renderBatch(const vector<DocumentJob>& jobs, const BatchOptions& options)
+{
+	auto start = std::chrono::steady_clock::now();
+
+	unsigned thread_count = options.threads ? options.threads : std::thread::hardware_concurrency();
+	thread_count = static_cast<unsigned>(std::min<size_t>(std::max(thread_count, 1u),
+		std::max<size_t>(jobs.size(), 1)));
+
+	// Workers own the block pools the queued documents draw from, so they
+	// are declared before, and outlive, the writer.
+	vector<std::unique_ptr<BatchWorker>> workers;
+	for (unsigned w = 0; w < thread_count; ++w) {
+		workers.push_back(std::unique_ptr<BatchWorker>(new BatchWorker(w)));
+	}
+	JobQueues queues(jobs.size(), thread_count);
+	WriteQueue writes(options.write_queue);
+	std::atomic<size_t> saved(0);
+	std::atomic<size_t> failed(0);
+	std::atomic<size_t> steals(0);
+
+	std::thread writer(writeDocuments, std::ref(writes), std::ref(saved), std::ref(failed));
+	vector<std::thread> threads;
+	for (unsigned w = 1; w < thread_count; ++w) {
+		threads.emplace_back(renderJobs, std::cref(jobs), std::ref(queues), std::ref(writes),
+			std::ref(*workers[w]), std::ref(failed), std::ref(steals));
+	}
+	renderJobs(jobs, queues, writes, *workers[0], failed, steals);
+	for (auto& thread: threads) {
+		thread.join();
+	}
+	writes.close();
+	writer.join();
+
+	BatchStats stats;
+	stats.documents = saved;
+	stats.failed = failed;
+	stats.steals = steals;
+	stats.seconds = std::chrono::duration<double>(std::chrono::steady_clock::now() - start).count();
+	return stats;
+}
+
+} // namespace svg
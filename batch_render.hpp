@@ -0,0 +1,112 @@
+
+/*******************************************************************************
+*  The "New BSD License" : http://www.opensource.org/licenses/bsd-license.php  *
+********************************************************************************
+
+Copyright (c) 2010, Mark Turney
+All rights reserved.
+
+Redistribution and use in source and binary forms, with or without
+modification, are permitted provided that the following conditions are met:
+	* Redistributions of source code must retain the above copyright
+	  notice, this list of conditions and the following disclaimer.
+	* Redistributions in binary form must reproduce the above copyright
+	  notice, this list of conditions and the following disclaimer in the
+	  documentation and/or other materials provided with the distribution.
+	* Neither the name of the <organization> nor the
+	  names of its contributors may be used to endorse or promote products
+	  derived from this software without specific prior written permission.
+
+THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS "AS IS" AND
+ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE IMPLIED
+WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE ARE
+DISCLAIMED. IN NO EVENT SHALL <COPYRIGHT HOLDER> BE LIABLE FOR ANY
+DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR CONSEQUENTIAL DAMAGES
+(INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS OR SERVICES;
+LOSS OF USE, DATA, OR PROFITS; OR BUSINESS INTERRUPTION) HOWEVER CAUSED AND
+ON ANY THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT LIABILITY, OR TORT
+(INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY OUT OF THE USE OF THIS
+SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF SUCH DAMAGE.
+
+******************************************************************************/
+#pragma once
+
+#include "simple_svg.hpp"
+
+namespace svg {
+
+// State a batch worker keeps across the documents it renders.  Its documents
+// take their blocks from blocks, and jobs can intern their styles in styles so
+// that colour names and other style attributes are rendered once per worker
+// rather than once per document, without sharing a locked pool.
+struct BatchWorker
+{
+	explicit BatchWorker(unsigned index) : index(index) { }
+
+	unsigned index;
+	BlockPool blocks;
+	StylePool styles;
+	// Holds a document's most recent shapes while it is being built; kept
+	// here so its capacity carries over to the worker's next document.
+	string scratch;
+
+private:
+	BatchWorker(const BatchWorker&) = delete;
+	BatchWorker& operator = (const BatchWorker&) = delete;
+};
+
+typedef std::function<void (Document& doc, BatchWorker& worker)> BuildDocument;
+
+// One document of a batch.  build is called on a worker thread and must only
+// touch state that no other job writes to.
+struct DocumentJob
+{
+	DocumentJob(const string& file_name, const Layout& layout, const BuildDocument& build)
+		:
+		file_name(file_name),
+		layout(layout),
+		build(build)
+	{ }
+
+	string file_name;
+	Layout layout;
+	BuildDocument build;
+};
+
+struct BatchOptions
+{
+	BatchOptions(unsigned threads = 0, size_t write_queue = 64)
+		:
+		threads(threads),
+		write_queue(write_queue)
+	{ }
+
+	// Render threads; 0 uses one per hardware thread.
+	unsigned threads;
+	// Finished documents waiting for the writer thread.  Workers wait while
+	// it's full, which bounds memory when the disk is the bottleneck.
+	size_t write_queue;
+};
+
+struct BatchStats
+{
+	BatchStats() : documents(0), failed(0), steals(0), seconds(0) { }
+
+	double documentsPerSecond() const { return seconds > 0 ? documents / seconds : 0; }
+
+	// Documents rendered and saved.
+	size_t documents;
+	// Documents whose build threw or whose file couldn't be written.
+	size_t failed;
+	// Jobs a worker took from another worker's queue.
+	size_t steals;
+	double seconds;
+};
+
+// Renders and saves every job.  Jobs are dealt out to per-worker queues and
+// idle workers steal from the others, so a few expensive documents don't
+// leave the remaining threads waiting.  Files are written by a separate
+// thread while the workers go on rendering.
+BatchStats renderBatch(const vector<DocumentJob>& jobs, const BatchOptions& options = BatchOptions());
+
+} // namespace svg
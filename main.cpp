@@ -31,11 +31,34 @@ SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF SUCH DAMAGE.
 ******************************************************************************/
 
 #include "simple_svg.hpp"
+#include "batch_render.hpp"
+#include "render_cache.hpp"
 #include "timer.h"
 #include <Windows.h>
+#include <cstdlib>
+#include <cstring>
+#include <new>
+#include <atomic>
 
 using namespace svg;
 
+// Counts heap allocations made by the benchmarks below.  Atomic because
+// renderBatch allocates from several threads.
+static std::atomic<size_t> g_allocation_count(0);
+
+void* operator new(size_t size)
+{
+	++g_allocation_count;
+	if (void* p = malloc(size ? size : 1))
+		return p;
+	throw std::bad_alloc();
+}
+
+void operator delete(void* p) throw()
+{
+	free(p);
+}
+
 // Demo page shows sample usage of the Simple SVG library.
 
 void demo()
@@ -142,11 +165,371 @@ void demo()
 	doc.save();
 }
 
-int main()
+// Builds a scene of small glyph-like polygons (3 to 16 vertices) with both
+// point containers and reports heap allocations and time.
+void benchSmallPolygons()
+{
+	const size_t count = 2000000;
+
+	size_t allocations = g_allocation_count;
+	Timer t;
+	{
+		vector<vector<Point>> scene;
+		scene.reserve(count);
+		for (size_t i = 0; i < count; ++i) {
+			scene.push_back(vector<Point>());
+			vector<Point>& points = scene.back();
+			size_t n = 3 + i % 14;
+			for (size_t j = 0; j < n; ++j)
+				points.push_back(Point(double(i), double(j)));
+		}
+	}
+	printf("vector<Point>: %u allocations, %f ms\n",
+		unsigned(g_allocation_count - allocations), t.ElapsedSecond() * 1000.0);
+
+	allocations = g_allocation_count;
+	t.Start();
+	{
+		vector<PointList> scene;
+		scene.reserve(count);
+		for (size_t i = 0; i < count; ++i) {
+			scene.push_back(PointList());
+			PointList& points = scene.back();
+			size_t n = 3 + i % 14;
+			for (size_t j = 0; j < n; ++j)
+				points.push_back(Point(double(i), double(j)));
+		}
+	}
+	printf("PointList:     %u allocations, %f ms\n",
+		unsigned(g_allocation_count - allocations), t.ElapsedSecond() * 1000.0);
+}
+
+// Serializes the same scene through Shape's vtable and through ShapeList,
+// once with mixed shape types and once with circles only.
+void benchShapeDispatch()
+{
+	const size_t count = 500000;
+	StylePool styles;
+	StyleRef style = styles.get(Color::Blue, Stroke(1, Color::Black));
+	Layout layout(Dimensions(1000, 1000));
+
+	for (int mixed = 1; mixed >= 0; --mixed) {
+		vector<std::unique_ptr<Shape>> shapes;
+		ShapeList list;
+		for (size_t i = 0; i < count; ++i) {
+			Point pt(double(i % 1000), double(i / 1000));
+			switch (mixed ? i % 3 : 0) {
+			case 0:
+				shapes.emplace_back(new Circle(pt, 4, style));
+				list << Circle(pt, 4, style);
+				break;
+			case 1:
+				shapes.emplace_back(new svg::Rectangle(pt, 3, 2, style));
+				list << svg::Rectangle(pt, 3, 2, style);
+				break;
+			case 2:
+				shapes.emplace_back(new Line(pt, Point(pt.x + 1, pt.y + 1), style));
+				list << Line(pt, Point(pt.x + 1, pt.y + 1), style);
+				break;
+			}
+		}
+
+		string s;
+		Timer t;
+		for (auto& shape: shapes)
+			shape->toString(s, layout);
+		double virtual_ms = t.ElapsedSecond() * 1000.0;
+
+		s.clear();
+		t.Start();
+		list.toString(s, layout);
+		double ordered_ms = t.ElapsedSecond() * 1000.0;
+
+		s.clear();
+		t.Start();
+		list.toStringByType(s, layout);
+		double by_type_ms = t.ElapsedSecond() * 1000.0;
+
+		printf("%s: virtual %f ms, ShapeList %f ms, by type %f ms\n",
+			mixed ? "mixed" : "circles", virtual_ms, ordered_ms, by_type_ms);
+	}
+}
+
+// Renders many charts that share a frame (border, title, axes, legend),
+// rebuilding the frame for each chart and then cloning a frozen template.
+static void addChartFrame(Document& doc, StyleRef frame_style, StyleRef title_style, StyleRef label_style)
+{
+	doc << svg::Rectangle(Point(0, 300), 400, 300, frame_style);
+	doc << Text(Point(150, 280), "Nightly throughput", title_style);
+	doc << (Polyline(frame_style) << Point(20, 280) << Point(20, 20) << Point(380, 20));
+	for (int i = 0; i <= 10; ++i) {
+		doc << Line(Point(20 + i * 36, 20), Point(20 + i * 36, 15), frame_style);
+		doc << Text(Point(16 + i * 36, 5), toString(i * 10), label_style);
+	}
+	doc << Line(Point(300, 270), Point(320, 270), frame_style);
+	doc << Text(Point(325, 267), "requests", label_style);
+}
+
+static void addChartData(Document& doc, StyleRef data_style, size_t chart)
+{
+	Polyline data(data_style);
+	for (int i = 0; i < 40; ++i)
+		data << Point(20 + i * 9, 20 + double((chart * 7 + i * 13) % 250));
+	doc << data;
+}
+
+void benchTemplateClone()
+{
+	const size_t count = 20000;
+	StylePool styles;
+	StyleRef frame_style = styles.get(Fill(), Stroke(1, Color::Black));
+	StyleRef title_style = styles.get(Color::Black, Stroke(), Font(14, "Verdana"));
+	StyleRef label_style = styles.get(Color::Black, Stroke(), Font(8, "Verdana"));
+	StyleRef data_style = styles.get(Fill(), Stroke(1, Color::Blue));
+	Layout layout(Dimensions(400, 300));
+	string s;
+
+	Timer t;
+	for (size_t i = 0; i < count; ++i) {
+		Document doc("chart.svg", layout);
+		addChartFrame(doc, frame_style, title_style, label_style);
+		addChartData(doc, data_style, i);
+		s.clear();
+		doc.toString(s);
+	}
+	double rebuild_ms = t.ElapsedSecond() * 1000.0;
+
+	Document frame("frame.svg", layout);
+	addChartFrame(frame, frame_style, title_style, label_style);
+	frame.freeze();
+	t.Start();
+	for (size_t i = 0; i < count; ++i) {
+		Document doc = frame.clone("chart.svg");
+		addChartData(doc, data_style, i);
+		s.clear();
+		doc.toString(s);
+	}
+	double clone_ms = t.ElapsedSecond() * 1000.0;
+
+	t.Start();
+	for (size_t i = 0; i < count; ++i) {
+		Document doc("chart.svg", layout);
+		addChartData(doc, data_style, i);
+		s.clear();
+		doc.toString(s);
+	}
+	double data_ms = t.ElapsedSecond() * 1000.0;
+
+	printf("charts: rebuild %f us, clone %f us, data only %f us per chart\n",
+		rebuild_ms * 1000.0 / count, clone_ms * 1000.0 / count, data_ms * 1000.0 / count);
+}
+
+// Renders and saves a batch of charts one after another and then through
+// renderBatch.
+void benchBatch()
+{
+	const size_t count = 5000;
+	char name[32];
+	auto build = [](Document& doc, StylePool& styles, size_t chart) {
+		addChartFrame(doc, styles.get(Fill(), Stroke(1, Color::Black)),
+			styles.get(Color::Black, Stroke(), Font(14, "Verdana")),
+			styles.get(Color::Black, Stroke(), Font(8, "Verdana")));
+		addChartData(doc, styles.get(Fill(), Stroke(1, Color::Blue)), chart);
+	};
+	Layout layout(Dimensions(400, 300));
+
+	Timer t;
+	StylePool styles;
+	for (size_t i = 0; i < count; ++i) {
+		sprintf(name, "batch_%u.svg", unsigned(i));
+		Document doc(name, layout);
+		build(doc, styles, i);
+		doc.save();
+	}
+	double serial_ms = t.ElapsedSecond() * 1000.0;
+
+	vector<DocumentJob> jobs;
+	for (size_t i = 0; i < count; ++i) {
+		sprintf(name, "batch_%u.svg", unsigned(i));
+		jobs.push_back(DocumentJob(name, layout, [=](Document& doc, BatchWorker& worker) {
+			build(doc, worker.styles, i);
+		}));
+	}
+	BatchStats stats = renderBatch(jobs);
+	printf("batch: serial %f docs/s, renderBatch %f docs/s (%u failed, %u steals)\n",
+		count / (serial_ms / 1000.0), stats.documentsPerSecond(),
+		unsigned(stats.failed), unsigned(stats.steals));
+
+	for (size_t i = 0; i < count; ++i) {
+		sprintf(name, "batch_%u.svg", unsigned(i));
+		remove(name);
+	}
+}
+
+// Culls a million randomly placed labels and compares the output with
+// writing all of them.
+void benchLabels()
+{
+	const size_t count = 1000000;
+	StylePool styles;
+	StyleRef style = styles.get(Color::Black, Stroke(), Font(10, "Verdana"));
+	LabelLayer layer(2);
+	srand(1);
+	for (size_t i = 0; i < count; ++i) {
+		Point origin(rand() % 1000, rand() % 1000);
+		layer.add(Text(origin, "label " + toString(int(i % 1000)), style), rand() % 100);
+	}
+	Layout layout(Dimensions(1000, 1000));
+
+	Timer t;
+	vector<size_t> kept = layer.visible(layout);
+	double cull_ms = t.ElapsedSecond() * 1000.0;
+
+	string all, culled;
+	for (auto& label: layer.labels)
+		label.toString(all, layout);
+	layer.toString(culled, layout);
+	printf("labels: kept %u of %u in %f ms, %u bytes instead of %u\n",
+		unsigned(kept.size()), unsigned(count), cull_ms, unsigned(culled.size()), unsigned(all.size()));
+}
+
+// Saves a batch of charts, then saves the same charts again through a
+// RenderCache, with saveIfChanged and by checking a ShapeList hash before
+// serializing.
+void benchRenderCache()
+{
+	const size_t count = 2000;
+	char name[32];
+	StylePool styles;
+	StyleRef frame_style = styles.get(Fill(), Stroke(1, Color::Black));
+	StyleRef title_style = styles.get(Color::Black, Stroke(), Font(14, "Verdana"));
+	StyleRef label_style = styles.get(Color::Black, Stroke(), Font(8, "Verdana"));
+	StyleRef data_style = styles.get(Fill(), Stroke(1, Color::Blue));
+	Layout layout(Dimensions(400, 300));
+	RenderCache cache("render_cache.txt");
+
+	double ms[3];
+	for (int pass = 0; pass < 3; ++pass) {
+		Timer t;
+		for (size_t i = 0; i < count; ++i) {
+			sprintf(name, "cached_%u.svg", unsigned(i));
+			Document doc(name, layout);
+			addChartFrame(doc, frame_style, title_style, label_style);
+			addChartData(doc, data_style, i);
+			if (pass == 0)
+				doc.save();
+			else if (pass == 1)
+				cache.save(doc);
+			else
+				doc.saveIfChanged();
+		}
+		ms[pass] = t.ElapsedSecond() * 1000.0;
+	}
+	// The scene is keyed by its ShapeList hash rather than the document's,
+	// so the next run can skip serializing it; both kinds of entry share the
+	// one manifest.
+	ShapeList scene;
+	for (size_t i = 0; i < 200000; ++i)
+		scene << Circle(Point(double(i % 400), double(i % 300)), 2, data_style);
+	{
+		Document doc("cached_scene.svg", layout);
+		doc << scene;
+		cache.save(doc, scene.hash(doc));
+	}
+	cache.saveManifest();
+
+	// cache.save() wrote every file on the first cached pass; time the next
+	// run, which starts from the manifest on disk and finds nothing changed.
+	RenderCache reloaded("render_cache.txt");
+	size_t rewritten = 0;
+	Timer t;
+	for (size_t i = 0; i < count; ++i) {
+		sprintf(name, "cached_%u.svg", unsigned(i));
+		Document doc(name, layout);
+		addChartFrame(doc, frame_style, title_style, label_style);
+		addChartData(doc, data_style, i);
+		bool written;
+		reloaded.save(doc, &written);
+		rewritten += written;
+	}
+	double cached_ms = t.ElapsedSecond() * 1000.0;
+
+	Document doc("cached_scene.svg", layout);
+	t.Start();
+	uint64_t key = scene.hash(doc);
+	bool skipped = reloaded.unchanged(doc.file_name, key);
+	double hash_ms = t.ElapsedSecond() * 1000.0;
+	t.Start();
+	doc << scene;
+	double serialize_ms = t.ElapsedSecond() * 1000.0;
+
+	printf("cache: save %f ms, first RenderCache pass %f ms, unchanged via reloaded RenderCache %f ms "
+		"(%u of %u rewritten), saveIfChanged %f ms; scene hash %f ms (%s) vs serialize %f ms (%016llx)\n",
+		ms[0], ms[1], cached_ms, unsigned(rewritten), unsigned(count), ms[2],
+		hash_ms, skipped ? "skipped" : "changed", serialize_ms, (unsigned long long)key);
+
+	for (size_t i = 0; i < count; ++i) {
+		sprintf(name, "cached_%u.svg", unsigned(i));
+		remove(name);
+	}
+	remove("cached_scene.svg");
+	remove("render_cache.txt");
+}
+
+// Writes a bar chart with markers with and without merge_shapes and
+// reports elements, bytes and time for both formats.
+void benchMergedShapes()
+{
+	const size_t bars = 20000;
+	StylePool styles;
+	StyleRef bar_style = styles.get(Color::Blue);
+	StyleRef marker_style = styles.get(Color::Red, Stroke(1, Color::Black));
+	ShapeList scene;
+	for (size_t i = 0; i < bars; ++i) {
+		double height = double((i * 37) % 250);
+		scene << svg::Rectangle(Point(i * 0.05, height), 0.04, height, bar_style);
+	}
+	for (size_t i = 0; i < bars; ++i)
+		scene << Circle(Point(i * 0.05, double((i * 37) % 250)), 0.5, marker_style);
+
+	for (int format = Layout::Pretty; format <= Layout::Minified; ++format) {
+		for (int merge = 0; merge <= 1; ++merge) {
+			Layout layout(Dimensions(1000, 300));
+			layout.format = Layout::Format(format);
+			Timer t;
+			Document doc("merged.svg", layout);
+			doc.merge_shapes = merge != 0;
+			doc << scene;
+			string s;
+			doc.toString(s);
+			double ms = t.ElapsedSecond() * 1000.0;
+			size_t elements = 0;
+			for (size_t i = 0; i + 1 < s.size(); ++i) {
+				if (s[i] == '<' && s[i + 1] != '/' && s[i + 1] != '?' && s[i + 1] != '!')
+					++elements;
+			}
+			printf("%s %s: %u elements, %u bytes, %f ms\n",
+				format == Layout::Minified ? "minified" : "pretty", merge ? "merged" : "separate",
+				unsigned(elements), unsigned(s.size()), ms);
+		}
+	}
+}
+
+int main(int argc, char* argv[])
 {
 	Timer t;
 	demo();
 	printf("%f\n", t.ElapsedSecond() * 1000.0);
+
+	if (argc > 1 && strcmp(argv[1], "bench") == 0) {
+		benchSmallPolygons();
+		benchShapeDispatch();
+		benchTemplateClone();
+		benchBatch();
+		benchLabels();
+		benchRenderCache();
+		benchMergedShapes();
+	}
 	return 0;
 }
 
@@ -0,0 +1,132 @@
+
+/*******************************************************************************
+*  The "New BSD License" : http://www.opensource.org/licenses/bsd-license.php  *
+********************************************************************************
+
+Copyright (c) 2010, Mark Turney
+All rights reserved.
+
+Redistribution and use in source and binary forms, with or without
+modification, are permitted provided that the following conditions are met:
+	* Redistributions of source code must retain the above copyright
+	  notice, this list of conditions and the following disclaimer.
+	* Redistributions in binary form must reproduce the above copyright
+	  notice, this list of conditions and the following disclaimer in the
+	  documentation and/or other materials provided with the distribution.
+	* Neither the name of the <organization> nor the
+	  names of its contributors may be used to endorse or promote products
+	  derived from this software without specific prior written permission.
+
+THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS "AS IS" AND
+ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE IMPLIED
+WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE ARE
+DISCLAIMED. IN NO EVENT SHALL <COPYRIGHT HOLDER> BE LIABLE FOR ANY
+DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR CONSEQUENTIAL DAMAGES
+(INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS OR SERVICES;
+LOSS OF USE, DATA, OR PROFITS; OR BUSINESS INTERRUPTION) HOWEVER CAUSED AND
+ON ANY THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT LIABILITY, OR TORT
+(INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY OUT OF THE USE OF THIS
+SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF SUCH DAMAGE.
+
+******************************************************************************/
+#include "render_cache.hpp"
+
+#include <cstdio>
+#include <cinttypes>
+
+namespace svg {
+
+// Size of file_name, or -1 if it can't be opened.
+static long long fileSize(const string& file_name)
+{
+	FILE* f = fopen(file_name.c_str(), "rb");
+	if (!f)
+		return -1;
+	long long size = -1;
+	if (fseek(f, 0, SEEK_END) == 0)
+		size = ftell(f);
+	fclose(f);
+	return size;
+}
+
+RenderCache::RenderCache(const string& manifest_file)
+	:
+	manifest_file(manifest_file),
+	dirty(false)
+{
+	FILE* f = fopen(manifest_file.c_str(), "rb");
+	if (!f)
+		return;
+	char line[4096];
+	while (fgets(line, sizeof(line), f)) {
+		uint64_t key, size;
+		int name_start = 0;
+		if (sscanf(line, "%" SCNx64 " %" SCNu64 " %n", &key, &size, &name_start) < 2 || !name_start)
+			continue;
+		string name(line + name_start);
+		while (!name.empty() && (name[name.size() - 1] == '\n' || name[name.size() - 1] == '\r'))
+			name.resize(name.size() - 1);
+		Entry entry = { key, size };
+		entries[name] = entry;
+	}
+	fclose(f);
+}
+
+bool RenderCache::unchanged(const string& file_name, uint64_t key) const
+{
+	auto it = entries.find(file_name);
+	if (it == entries.end() || it->second.key != key)
+		return false;
+	return fileSize(file_name) == static_cast<long long>(it->second.size);
+}
+
+void RenderCache::update(const string& file_name, uint64_t key, uint64_t size)
+{
+	Entry& entry = entries[file_name];
+	if (entry.key != key || entry.size != size) {
+		entry.key = key;
+		entry.size = size;
+		dirty = true;
+	}
+}
+
+bool RenderCache::save(const Document& doc, bool* written)
+{
+	return save(doc, doc.hash(), written);
+}
+
+bool RenderCache::save(const Document& doc, uint64_t key, bool* written)
+{
+	if (written) {
+		*written = false;
+	}
+	if (unchanged(doc.file_name, key))
+		return true;
+	if (written) {
+		*written = true;
+	}
+	if (!doc.save())
+		return false;
+	update(doc.file_name, key, doc.size());
+	return true;
+}
+
+bool RenderCache::saveManifest() const
+{
+	if (!dirty)
+		return true;
+	FILE* f = fopen(manifest_file.c_str(), "wb");
+	if (!f)
+		return false;
+	bool ok = true;
+	for (auto& entry: entries) {
+		ok = fprintf(f, "%016" PRIx64 " %" PRIu64 " %s\n",
+			entry.second.key, entry.second.size, entry.first.c_str()) > 0 && ok;
+	}
+	ok = fclose(f) == 0 && ok;
+	if (ok)
+		dirty = false;
+	return ok;
+}
+
+} // namespace svg
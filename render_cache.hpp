@@ -0,0 +1,80 @@
+
+/*******************************************************************************
+*  The "New BSD License" : http://www.opensource.org/licenses/bsd-license.php  *
+********************************************************************************
+
+Copyright (c) 2010, Mark Turney
+All rights reserved.
+
+Redistribution and use in source and binary forms, with or without
+modification, are permitted provided that the following conditions are met:
+	* Redistributions of source code must retain the above copyright
+	  notice, this list of conditions and the following disclaimer.
+	* Redistributions in binary form must reproduce the above copyright
+	  notice, this list of conditions and the following disclaimer in the
+	  documentation and/or other materials provided with the distribution.
+	* Neither the name of the <organization> nor the
+	  names of its contributors may be used to endorse or promote products
+	  derived from this software without specific prior written permission.
+
+THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS "AS IS" AND
+ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE IMPLIED
+WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE ARE
+DISCLAIMED. IN NO EVENT SHALL <COPYRIGHT HOLDER> BE LIABLE FOR ANY
+DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR CONSEQUENTIAL DAMAGES
+(INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS OR SERVICES;
+LOSS OF USE, DATA, OR PROFITS; OR BUSINESS INTERRUPTION) HOWEVER CAUSED AND
+ON ANY THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT LIABILITY, OR TORT
+(INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY OUT OF THE USE OF THIS
+SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF SUCH DAMAGE.
+
+******************************************************************************/
+#pragma once
+
+#include "simple_svg.hpp"
+
+namespace svg {
+
+// Manifest of the files a job wrote and the hash of each one's content, kept
+// between runs so that files whose content hasn't changed are neither
+// rewritten nor, when the caller checks a ShapeList hash first, even
+// serialized.
+//
+// The manifest is a text file with one "<hash> <size> <file name>" line per
+// entry.  An entry only counts while the file still exists with the recorded
+// size.
+class RenderCache
+{
+public:
+	// Loads manifest_file if it exists; a missing or unreadable manifest
+	// starts an empty cache.
+	explicit RenderCache(const string& manifest_file);
+
+	// True if file_name was last written with this key and is still there.
+	bool unchanged(const string& file_name, uint64_t key) const;
+	void update(const string& file_name, uint64_t key, uint64_t size);
+
+	// Saves doc unless unchanged(doc.file_name, doc.hash()).  Sets *written
+	// to whether the file was written.
+	bool save(const Document& doc, bool* written = nullptr);
+	// Same, under a caller-supplied key such as ShapeList::hash(), so that a
+	// job which checks unchanged() before serializing records the same key.
+	bool save(const Document& doc, uint64_t key, bool* written = nullptr);
+	// Writes the manifest back if it changed.
+	bool saveManifest() const;
+
+	size_t size() const { return entries.size(); }
+
+private:
+	struct Entry
+	{
+		uint64_t key;
+		uint64_t size;
+	};
+
+	string manifest_file;
+	std::unordered_map<string, Entry> entries;
+	mutable bool dirty;
+};
+
+} // namespace svg
@@ -0,0 +1,558 @@
+
+/*******************************************************************************
+*  The "New BSD License" : http://www.opensource.org/licenses/bsd-license.php  *
+********************************************************************************
+
+Copyright (c) 2010, Mark Turney
+All rights reserved.
+
+Redistribution and use in source and binary forms, with or without
+modification, are permitted provided that the following conditions are met:
+	* Redistributions of source code must retain the above copyright
+	  notice, this list of conditions and the following disclaimer.
+	* Redistributions in binary form must reproduce the above copyright
+	  notice, this list of conditions and the following disclaimer in the
+	  documentation and/or other materials provided with the distribution.
+	* Neither the name of the <organization> nor the
+	  names of its contributors may be used to endorse or promote products
+	  derived from this software without specific prior written permission.
+
+THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS "AS IS" AND
+ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE IMPLIED
+WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE ARE
+DISCLAIMED. IN NO EVENT SHALL <COPYRIGHT HOLDER> BE LIABLE FOR ANY
+DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR CONSEQUENTIAL DAMAGES
+(INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS OR SERVICES;
+LOSS OF USE, DATA, OR PROFITS; OR BUSINESS INTERRUPTION) HOWEVER CAUSED AND
+ON ANY THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT LIABILITY, OR TORT
+(INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY OUT OF THE USE OF THIS
+SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF SUCH DAMAGE.
+
+******************************************************************************/
+
+#include "scene_cache.hpp"
+
+#include <cstdio>
+#include <cstring>
+#include <cstdint>
+#include <unordered_map>
+
+#ifdef _WIN32
+#define NOMINMAX
+#include <windows.h>
+#else
+#include <fcntl.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <unistd.h>
+#endif
+
+namespace svg {
+
+namespace {
+
+const char scene_magic[4] = { 'S', 'S', 'V', 'G' };
+const uint32_t scene_version = 1;
+const uint32_t no_color = 0xFFFFFFFF;
+
+// All records are padded to a multiple of 8 bytes so the arrays that follow
+// each other in the file stay aligned for the doubles they contain.
+struct SceneHeader
+{
+	char magic[4];
+	uint32_t version;
+	uint32_t style_count;
+	uint32_t dash_count;
+	uint32_t shape_count;
+	uint32_t circle_count;
+	uint32_t elipse_count;
+	uint32_t rectangle_count;
+	uint32_t line_count;
+	uint32_t polygon_count;
+	uint32_t polyline_count;
+	uint32_t text_count;
+	uint32_t point_count;
+	uint32_t char_count;
+};
+
+struct StyleRecord
+{
+	double stroke_width;
+	double font_size;
+	uint32_t fill_color;
+	uint32_t stroke_color;
+	int32_t linecap;
+	uint32_t dash_first;
+	uint32_t dash_count;
+	uint32_t family_offset;
+	uint32_t family_size;
+	uint32_t padding;
+};
+
+struct CircleRecord
+{
+	double cx, cy, r;
+	uint32_t style;
+	uint32_t padding;
+};
+
+// Ellipses, rectangles and lines: a point plus two more values, which are
+// the radii, the size or the end point respectively.
+struct BoxRecord
+{
+	double x, y, width, height;
+	uint32_t style;
+	uint32_t padding;
+};
+
+struct PathRecord
+{
+	uint32_t style;
+	uint32_t first_point;
+	uint32_t point_count;
+	uint32_t padding;
+};
+
+struct TextRecord
+{
+	double x, y;
+	uint32_t style;
+	uint32_t content_offset;
+	uint32_t content_size;
+	uint32_t padding;
+};
+
+size_t aligned(size_t n)
+{
+	return (n + 7) & ~size_t(7);
+}
+
+uint32_t packColor(const Color& color)
+{
+	if (color.transparent)
+		return no_color;
+	return (uint32_t(color.red & 0xFF) << 16) | (uint32_t(color.green & 0xFF) << 8) | uint32_t(color.blue & 0xFF);
+}
+
+Color unpackColor(uint32_t packed)
+{
+	if (packed == no_color)
+		return Color::Transparent;
+	return Color((packed >> 16) & 0xFF, (packed >> 8) & 0xFF, packed & 0xFF);
+}
+
+template <typename T>
+void appendArray(string& out, const vector<T>& records)
+{
+	if (!records.empty())
+		out.append(reinterpret_cast<const char*>(&records[0]), records.size() * sizeof(T));
+	out.resize(aligned(out.size()));
+}
+
+// Collects the distinct styles of a scene.
+struct StyleTable
+{
+	uint32_t add(const StyleRef& style, string& chars)
+	{
+		auto it = indices.find(style.get());
+		if (it != indices.end())
+			return it->second;
+		const Stroke& stroke = style->stroke();
+		const Font& font = style->font();
+		StyleRecord record;
+		memset(&record, 0, sizeof(record));
+		record.stroke_width = stroke.width;
+		record.font_size = font.size;
+		record.fill_color = packColor(style->fill().color);
+		record.stroke_color = packColor(stroke.color);
+		record.linecap = stroke.linecap ? int32_t(*stroke.linecap) : -1;
+		record.dash_first = uint32_t(dashes.size());
+		record.dash_count = uint32_t(stroke.dasharray.size());
+		dashes.insert(dashes.end(), stroke.dasharray.begin(), stroke.dasharray.end());
+		record.family_offset = uint32_t(chars.size());
+		record.family_size = uint32_t(font.family.size());
+		chars += font.family;
+		uint32_t index = uint32_t(records.size());
+		records.push_back(record);
+		indices[style.get()] = index;
+		return index;
+	}
+
+	std::unordered_map<const Style*, uint32_t> indices;
+	vector<StyleRecord> records;
+	vector<double> dashes;
+};
+
+} // namespace
+
+struct MappedScene::Sections
+{
+	const SceneHeader* header;
+	const StyleRecord* styles;
+	const double* dashes;
+	const uint8_t* order;
+	const CircleRecord* circles;
+	const BoxRecord* elipses;
+	const BoxRecord* rectangles;
+	const BoxRecord* lines;
+	const PathRecord* polygons;
+	const PathRecord* polylines;
+	const Point* points;
+	const TextRecord* texts;
+	const char* chars;
+};
+
+bool saveScene(const ShapeList& shapes, const string& file_name)
+{
+	StyleTable table;
+	string chars;
+	vector<uint8_t> order;
+	order.reserve(shapes.order.size());
+	for (auto& entry: shapes.order) {
+		order.push_back(uint8_t(entry.type));
+	}
+
+	vector<CircleRecord> circles;
+	for (auto& c: shapes.circles) {
+		CircleRecord r = { c.center.x, c.center.y, c.radius, table.add(c.style, chars), 0 };
+		circles.push_back(r);
+	}
+	vector<BoxRecord> elipses;
+	for (auto& e: shapes.elipses) {
+		BoxRecord r = { e.center.x, e.center.y, e.radius_width, e.radius_height, table.add(e.style, chars), 0 };
+		elipses.push_back(r);
+	}
+	vector<BoxRecord> rectangles;
+	for (auto& rect: shapes.rectangles) {
+		BoxRecord r = { rect.edge.x, rect.edge.y, rect.width, rect.height, table.add(rect.style, chars), 0 };
+		rectangles.push_back(r);
+	}
+	vector<BoxRecord> lines;
+	for (auto& l: shapes.lines) {
+		BoxRecord r = { l.start_point.x, l.start_point.y, l.end_point.x, l.end_point.y, table.add(l.style, chars), 0 };
+		lines.push_back(r);
+	}
+	vector<Point> points;
+	vector<PathRecord> polygons;
+	for (auto& p: shapes.polygons) {
+		PathRecord r = { table.add(p.style, chars), uint32_t(points.size()), uint32_t(p.points.size()), 0 };
+		points.insert(points.end(), p.points.begin(), p.points.end());
+		polygons.push_back(r);
+	}
+	vector<PathRecord> polylines;
+	for (auto& p: shapes.polylines) {
+		PathRecord r = { table.add(p.style, chars), uint32_t(points.size()), uint32_t(p.points.size()), 0 };
+		points.insert(points.end(), p.points.begin(), p.points.end());
+		polylines.push_back(r);
+	}
+	vector<TextRecord> texts;
+	for (auto& t: shapes.texts) {
+		TextRecord r = { t.origin.x, t.origin.y, table.add(t.style, chars),
+			uint32_t(chars.size()), uint32_t(t.content.size()), 0 };
+		chars += t.content;
+		texts.push_back(r);
+	}
+
+	SceneHeader header;
+	memset(&header, 0, sizeof(header));
+	memcpy(header.magic, scene_magic, sizeof(scene_magic));
+	header.version = scene_version;
+	header.style_count = uint32_t(table.records.size());
+	header.dash_count = uint32_t(table.dashes.size());
+	header.shape_count = uint32_t(order.size());
+	header.circle_count = uint32_t(circles.size());
+	header.elipse_count = uint32_t(elipses.size());
+	header.rectangle_count = uint32_t(rectangles.size());
+	header.line_count = uint32_t(lines.size());
+	header.polygon_count = uint32_t(polygons.size());
+	header.polyline_count = uint32_t(polylines.size());
+	header.text_count = uint32_t(texts.size());
+	header.point_count = uint32_t(points.size());
+	header.char_count = uint32_t(chars.size());
+
+	string out(reinterpret_cast<const char*>(&header), sizeof(header));
+	out.resize(aligned(out.size()));
+	appendArray(out, table.records);
+	appendArray(out, table.dashes);
+	appendArray(out, order);
+	appendArray(out, circles);
+	appendArray(out, elipses);
+	appendArray(out, rectangles);
+	appendArray(out, lines);
+	appendArray(out, polygons);
+	appendArray(out, polylines);
+	appendArray(out, points);
+	appendArray(out, texts);
+	out += chars;
+
+	FILE* f = fopen(file_name.c_str(), "wb");
+	if (!f) {
+		return false;
+	}
+	bool ok = fwrite(out.data(), 1, out.size(), f) == out.size();
+	ok = fclose(f) == 0 && ok;
+	return ok;
+}
+
+MappedScene::MappedScene()
+	:
+	data(nullptr),
+	bytes(0),
+	file_handle(nullptr),
+	mapping_handle(nullptr)
+{ }
+
+MappedScene::~MappedScene()
+{
+	close();
+}
+
+bool MappedScene::open(const string& file_name)
+{
+	close();
+#ifdef _WIN32
+	HANDLE file = CreateFileA(file_name.c_str(), GENERIC_READ, FILE_SHARE_READ, NULL,
+		OPEN_EXISTING, FILE_ATTRIBUTE_NORMAL, NULL);
+	if (file == INVALID_HANDLE_VALUE)
+		return false;
+	LARGE_INTEGER size;
+	if (!GetFileSizeEx(file, &size) || size.QuadPart == 0) {
+		CloseHandle(file);
+		return false;
+	}
+	HANDLE mapping = CreateFileMappingA(file, NULL, PAGE_READONLY, 0, 0, NULL);
+	if (!mapping) {
+		CloseHandle(file);
+		return false;
+	}
+	const void* view = MapViewOfFile(mapping, FILE_MAP_READ, 0, 0, 0);
+	if (!view) {
+		CloseHandle(mapping);
+		CloseHandle(file);
+		return false;
+	}
+	file_handle = file;
+	mapping_handle = mapping;
+	data = static_cast<const char*>(view);
+	bytes = size_t(size.QuadPart);
+#else
+	int fd = ::open(file_name.c_str(), O_RDONLY);
+	if (fd < 0)
+		return false;
+	struct stat st;
+	if (fstat(fd, &st) != 0 || st.st_size == 0) {
+		::close(fd);
+		return false;
+	}
+	void* view = mmap(nullptr, size_t(st.st_size), PROT_READ, MAP_PRIVATE, fd, 0);
+	::close(fd);
+	if (view == MAP_FAILED)
+		return false;
+	data = static_cast<const char*>(view);
+	bytes = size_t(st.st_size);
+#endif
+	if (!parse()) {
+		close();
+		return false;
+	}
+	return true;
+}
+
+void MappedScene::close()
+{
+	if (data) {
+#ifdef _WIN32
+		UnmapViewOfFile(data);
+		CloseHandle(mapping_handle);
+		CloseHandle(file_handle);
+#else
+		munmap(const_cast<char*>(data), bytes);
+#endif
+	}
+	data = nullptr;
+	bytes = 0;
+	file_handle = nullptr;
+	mapping_handle = nullptr;
+	styles.clear();
+	sections.reset();
+}
+
+size_t MappedScene::size() const
+{
+	return sections ? sections->header->shape_count : 0;
+}
+
+// Sets up the section pointers, checking that every array lies within the
+// file, and rebuilds the style table.
+bool MappedScene::parse()
+{
+	if (bytes < sizeof(SceneHeader))
+		return false;
+	const SceneHeader* header = reinterpret_cast<const SceneHeader*>(data);
+	if (memcmp(header->magic, scene_magic, sizeof(scene_magic)) != 0 || header->version != scene_version)
+		return false;
+
+	std::unique_ptr<Sections> sec(new Sections());
+	sec->header = header;
+	size_t offset = aligned(sizeof(SceneHeader));
+	bool fits = true;
+	auto take = [&](size_t count, size_t record_size) -> const char* {
+		const char* p = data + offset;
+		if (bytes < offset || (bytes - offset) / record_size < count)
+			fits = false;
+		offset = aligned(offset + count * record_size);
+		return p;
+	};
+	sec->styles = reinterpret_cast<const StyleRecord*>(take(header->style_count, sizeof(StyleRecord)));
+	sec->dashes = reinterpret_cast<const double*>(take(header->dash_count, sizeof(double)));
+	sec->order = reinterpret_cast<const uint8_t*>(take(header->shape_count, 1));
+	sec->circles = reinterpret_cast<const CircleRecord*>(take(header->circle_count, sizeof(CircleRecord)));
+	sec->elipses = reinterpret_cast<const BoxRecord*>(take(header->elipse_count, sizeof(BoxRecord)));
+	sec->rectangles = reinterpret_cast<const BoxRecord*>(take(header->rectangle_count, sizeof(BoxRecord)));
+	sec->lines = reinterpret_cast<const BoxRecord*>(take(header->line_count, sizeof(BoxRecord)));
+	sec->polygons = reinterpret_cast<const PathRecord*>(take(header->polygon_count, sizeof(PathRecord)));
+	sec->polylines = reinterpret_cast<const PathRecord*>(take(header->polyline_count, sizeof(PathRecord)));
+	sec->points = reinterpret_cast<const Point*>(take(header->point_count, sizeof(Point)));
+	sec->texts = reinterpret_cast<const TextRecord*>(take(header->text_count, sizeof(TextRecord)));
+	sec->chars = take(header->char_count, 1);
+	if (!fits)
+		return false;
+
+	// Validate every index once here so toString can trust the records.
+	size_t type_counts[ShapeList::TextType + 1] = { 0 };
+	for (uint32_t i = 0; i < header->shape_count; ++i) {
+		if (sec->order[i] > ShapeList::TextType)
+			return false;
+		++type_counts[sec->order[i]];
+	}
+	if (type_counts[ShapeList::CircleType] != header->circle_count
+		|| type_counts[ShapeList::ElipseType] != header->elipse_count
+		|| type_counts[ShapeList::RectangleType] != header->rectangle_count
+		|| type_counts[ShapeList::LineType] != header->line_count
+		|| type_counts[ShapeList::PolygonType] != header->polygon_count
+		|| type_counts[ShapeList::PolylineType] != header->polyline_count
+		|| type_counts[ShapeList::TextType] != header->text_count)
+		return false;
+	auto validStyle = [&](uint32_t style) { return style < header->style_count; };
+	auto validPath = [&](const PathRecord& r) {
+		return validStyle(r.style) && r.first_point <= header->point_count
+			&& r.point_count <= header->point_count - r.first_point;
+	};
+	auto validChars = [&](uint32_t first, uint32_t count) {
+		return first <= header->char_count && count <= header->char_count - first;
+	};
+	for (uint32_t i = 0; i < header->circle_count; ++i)
+		if (!validStyle(sec->circles[i].style)) return false;
+	for (uint32_t i = 0; i < header->elipse_count; ++i)
+		if (!validStyle(sec->elipses[i].style)) return false;
+	for (uint32_t i = 0; i < header->rectangle_count; ++i)
+		if (!validStyle(sec->rectangles[i].style)) return false;
+	for (uint32_t i = 0; i < header->line_count; ++i)
+		if (!validStyle(sec->lines[i].style)) return false;
+	for (uint32_t i = 0; i < header->polygon_count; ++i)
+		if (!validPath(sec->polygons[i])) return false;
+	for (uint32_t i = 0; i < header->polyline_count; ++i)
+		if (!validPath(sec->polylines[i])) return false;
+	for (uint32_t i = 0; i < header->text_count; ++i) {
+		const TextRecord& r = sec->texts[i];
+		if (!validStyle(r.style) || !validChars(r.content_offset, r.content_size))
+			return false;
+	}
+
+	styles.reserve(header->style_count);
+	for (uint32_t i = 0; i < header->style_count; ++i) {
+		const StyleRecord& r = sec->styles[i];
+		if (r.dash_first > header->dash_count || r.dash_count > header->dash_count - r.dash_first
+			|| !validChars(r.family_offset, r.family_size) || r.linecap > int32_t(Stroke::Linecap::square))
+			return false;
+		Stroke stroke(r.stroke_width, unpackColor(r.stroke_color));
+		if (r.linecap >= 0)
+			stroke.linecap = Stroke::Linecap(r.linecap);
+		stroke.dasharray.assign(sec->dashes + r.dash_first, sec->dashes + r.dash_first + r.dash_count);
+		Font font(r.font_size, string(sec->chars + r.family_offset, r.family_size));
+		auto style = std::make_shared<Style>(Fill(unpackColor(r.fill_color)), stroke, font);
+		style->prerender();
+		styles.push_back(style);
+	}
+	sections = std::move(sec);
+	return true;
+}
+
+void MappedScene::toString(string& s, const Layout& layout) const
+{
+	write(s, layout, nullptr);
+}
+
+void MappedScene::serialize(Document& doc) const
+{
+	write(doc.pending, doc.layout, &doc);
+}
+
+Document& Document::operator << (const MappedScene& scene)
+{
+	endRun();
+	scene.serialize(*this);
+	return *this;
+}
+
+MultiDocument& MultiDocument::operator << (const MappedScene& scene)
+{
+	for (auto& doc: documents) {
+		doc << scene;
+	}
+	return *this;
+}
+
+// s is doc's pending string when doc is given.
+void MappedScene::write(string& s, const Layout& layout, Document* doc) const
+{
+	if (!sections)
+		return;
+	const Sections& sec = *sections;
+	size_t next[ShapeList::TextType + 1] = { 0 };
+	for (uint32_t i = 0; i < sec.header->shape_count; ++i) {
+		uint8_t type = sec.order[i];
+		size_t index = next[type]++;
+		switch (type) {
+		case ShapeList::CircleType: {
+			const CircleRecord& r = sec.circles[index];
+			Circle::toString(s, layout, Point(r.cx, r.cy), r.r, *styles[r.style]);
+			break;
+		}
+		case ShapeList::ElipseType: {
+			const BoxRecord& r = sec.elipses[index];
+			Elipse::toString(s, layout, Point(r.x, r.y), r.width, r.height, *styles[r.style]);
+			break;
+		}
+		case ShapeList::RectangleType: {
+			const BoxRecord& r = sec.rectangles[index];
+			Rectangle::toString(s, layout, Point(r.x, r.y), r.width, r.height, *styles[r.style]);
+			break;
+		}
+		case ShapeList::LineType: {
+			const BoxRecord& r = sec.lines[index];
+			Line::toString(s, layout, Point(r.x, r.y), Point(r.width, r.height), *styles[r.style]);
+			break;
+		}
+		case ShapeList::PolygonType: {
+			const PathRecord& r = sec.polygons[index];
+			Polygon::toString(s, layout, sec.points + r.first_point, r.point_count, *styles[r.style]);
+			break;
+		}
+		case ShapeList::PolylineType: {
+			const PathRecord& r = sec.polylines[index];
+			Polyline::toString(s, layout, sec.points + r.first_point, r.point_count, *styles[r.style]);
+			break;
+		}
+		case ShapeList::TextType: {
+			const TextRecord& r = sec.texts[index];
+			Text::toString(s, layout, Point(r.x, r.y), sec.chars + r.content_offset, r.content_size, *styles[r.style]);
+			break;
+		}
+		}
+		if (doc)
+			doc->commit();
+	}
+}
+
+} // namespace svg
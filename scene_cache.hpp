@@ -0,0 +1,81 @@
+
+/*******************************************************************************
+*  The "New BSD License" : http://www.opensource.org/licenses/bsd-license.php  *
+********************************************************************************
+
+Copyright (c) 2010, Mark Turney
+All rights reserved.
+
+Redistribution and use in source and binary forms, with or without
+modification, are permitted provided that the following conditions are met:
+	* Redistributions of source code must retain the above copyright
+	  notice, this list of conditions and the following disclaimer.
+	* Redistributions in binary form must reproduce the above copyright
+	  notice, this list of conditions and the following disclaimer in the
+	  documentation and/or other materials provided with the distribution.
+	* Neither the name of the <organization> nor the
+	  names of its contributors may be used to endorse or promote products
+	  derived from this software without specific prior written permission.
+
+THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS "AS IS" AND
+ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE IMPLIED
+WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE ARE
+DISCLAIMED. IN NO EVENT SHALL <COPYRIGHT HOLDER> BE LIABLE FOR ANY
+DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR CONSEQUENTIAL DAMAGES
+(INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS OR SERVICES;
+LOSS OF USE, DATA, OR PROFITS; OR BUSINESS INTERRUPTION) HOWEVER CAUSED AND
+ON ANY THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT LIABILITY, OR TORT
+(INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY OUT OF THE USE OF THIS
+SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF SUCH DAMAGE.
+
+******************************************************************************/
+
+#pragma once
+
+#include "simple_svg.hpp"
+
+namespace svg {
+
+// Binary snapshot of a ShapeList.  Geometry is stored in flat per-type arrays
+// and styles in a table, behind a versioned header.  The file uses the
+// writer's native byte order and is meant as a cache, not an interchange
+// format.
+bool saveScene(const ShapeList& shapes, const string& file_name);
+
+// Read-only view of a saved scene, memory-mapped straight from disk.  Only
+// the style table is turned back into objects; the geometry is read in place
+// each time the scene is serialized, under whatever Layout is passed in.
+class MappedScene : public Serializeable
+{
+public:
+	MappedScene();
+	~MappedScene();
+
+	// Returns false if the file can't be mapped or isn't a valid scene.
+	bool open(const string& file_name);
+	void close();
+	bool isOpen() const { return data != nullptr; }
+
+	size_t size() const;
+	void toString(string& s, const Layout& layout) const override;
+	// Commits to doc after every record.  Called by Document::operator <<.
+	void serialize(Document& doc) const;
+
+private:
+	MappedScene(const MappedScene&) = delete;
+	MappedScene& operator = (const MappedScene&) = delete;
+
+	bool parse();
+	void write(string& s, const Layout& layout, Document* doc) const;
+
+	struct Sections;
+
+	const char* data;
+	size_t bytes;
+	void* file_handle;
+	void* mapping_handle;
+	vector<StyleRef> styles;
+	std::unique_ptr<Sections> sections;
+};
+
+} // namespace svg
@@ -0,0 +1,2395 @@
+
+/*******************************************************************************
+*  The "New BSD License" : http://www.opensource.org/licenses/bsd-license.php  *
+********************************************************************************
+
+Copyright (c) 2010, Mark Turney
+All rights reserved.
+
+Redistribution and use in source and binary forms, with or without
+modification, are permitted provided that the following conditions are met:
+	* Redistributions of source code must retain the above copyright
+	  notice, this list of conditions and the following disclaimer.
+	* Redistributions in binary form must reproduce the above copyright
+	  notice, this list of conditions and the following disclaimer in the
+	  documentation and/or other materials provided with the distribution.
+	* Neither the name of the <organization> nor the
+	  names of its contributors may be used to endorse or promote products
+	  derived from this software without specific prior written permission.
+
+THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS "AS IS" AND
+ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE IMPLIED
+WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE ARE
+DISCLAIMED. IN NO EVENT SHALL <COPYRIGHT HOLDER> BE LIABLE FOR ANY
+DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR CONSEQUENTIAL DAMAGES
+(INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS OR SERVICES;
+LOSS OF USE, DATA, OR PROFITS; OR BUSINESS INTERRUPTION) HOWEVER CAUSED AND
+ON ANY THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT LIABILITY, OR TORT
+(INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY OUT OF THE USE OF THIS
+SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF SUCH DAMAGE.
+
+******************************************************************************/
+
+#include "simple_svg.hpp"
+
+#include <cstdio>
+#include <cstring>
+#include <algorithm>
+#include <cmath>
+#include <thread>
+#include <climits>
+#include <cerrno>
+#include <cctype>
+#include <boost/lexical_cast.hpp>
+
+#ifndef _WIN32
+#include <fcntl.h>
+#include <sys/uio.h>
+#include <unistd.h>
+#endif
+
+#ifndef IOV_MAX
+#define IOV_MAX 1024
+#endif
+
+namespace svg {
+
+// Utility XML/String Functions.
+string toString(bool v)
+{
+	return boost::lexical_cast<string>(v);
+}
+string toString(char v)
+{
+	return string(1, v);
+}
+string toString(int v)
+{
+	return boost::lexical_cast<string>(v);
+}
+string toString(unsigned v)
+{
+	return boost::lexical_cast<string>(v);
+}
+string toString(long v)
+{
+	return boost::lexical_cast<string>(v);
+}
+string toString(unsigned long v)
+{
+	return boost::lexical_cast<string>(v);
+}
+string toString(long long v)
+{
+	return boost::lexical_cast<string>(v);
+}
+string toString(unsigned long long v)
+{
+	return boost::lexical_cast<string>(v);
+}
+string toString(float v)
+{
+	return boost::lexical_cast<string>(v);
+}
+string toString(double v)
+{
+	return boost::lexical_cast<string>(v);
+}
+string toString(const string& v)
+{
+	return v;
+}
+string toString(const char* v)
+{
+	return v;
+}
+
+void elemStart(string& s, const string& element_name)
+{
+	s += "\t<";
+	s += element_name;
+	s += " ";
+}
+string elemEnd(const string& element_name)
+{
+	return "</" + element_name + ">\n";
+}
+string emptyElemEnd()
+{
+	return "/>\n";
+}
+
+void elemStart(string& s, const string& element_name, const Layout& layout)
+{
+	s += layout.minified() ? "<" : "\t<";
+	s += element_name;
+	s += " ";
+}
+
+// Minified attributes still end with a separating space; drop it before the
+// tag is closed.
+static void trimSpace(string& s, const Layout& layout)
+{
+	if (layout.minified() && !s.empty() && s[s.size() - 1] == ' ')
+		s.resize(s.size() - 1);
+}
+
+void startTagEnd(string& s, const Layout& layout)
+{
+	trimSpace(s, layout);
+	s += ">";
+}
+
+void elemEnd(string& s, const string& element_name, const Layout& layout)
+{
+	s += "</";
+	s += element_name;
+	s += layout.minified() ? ">" : ">\n";
+}
+
+void emptyElemEnd(string& s, const Layout& layout)
+{
+	trimSpace(s, layout);
+	s += layout.minified() ? "/>" : "/>\n";
+}
+
+// VS2013 (v120) has no snprintf.  %.17g fits the buffer below, so
+// _snprintf's missing terminator on truncation can't bite.
+#if defined(_MSC_VER) && _MSC_VER < 1900
+#define snprintf _snprintf
+#endif
+
+// Shortest decimal form that reads back as the same double, without a
+// leading zero ("0.5" becomes ".5").
+static void shortestNumber(string& s, double value)
+{
+	if (value == 0) {
+		s += "0";
+		return;
+	}
+	char buf[32];
+	for (int precision = 15; precision <= 17; ++precision) {
+		snprintf(buf, sizeof(buf), "%.*g", precision, value);
+		if (strtod(buf, nullptr) == value)
+			break;
+	}
+	const char* p = buf;
+	if (p[0] == '0' && p[1] == '.') {
+		++p;
+	} else if (p[0] == '-' && p[1] == '0' && p[2] == '.') {
+		s += '-';
+		p += 2;
+	}
+	s += p;
+}
+
+void numberToString(string& s, double value, const Layout& layout)
+{
+	if (layout.minified())
+		shortestNumber(s, value);
+	else
+		s += svg::toString(value);
+}
+
+void attribute(
+	string& s,
+	const string& attribute_name,
+	double value,
+	const Layout& layout)
+{
+	s += attribute_name;
+	s += "=\"";
+	numberToString(s, value, layout);
+	s += "\" ";
+}
+
+void coordinateAttribute(
+	string& s,
+	const string& attribute_name,
+	double value,
+	const Layout& layout)
+{
+	if (layout.minified() && value == 0)
+		return;
+	attribute(s, attribute_name, value, layout);
+}
+
+PointList::PointList(const Point* points, size_t count)
+	:
+	data_(inlineData()),
+	size_(0),
+	capacity_(inline_capacity)
+{
+	append(points, count);
+}
+
+PointList::PointList(initializer_list<Point> points)
+	:
+	data_(inlineData()),
+	size_(0),
+	capacity_(inline_capacity)
+{
+	append(points.begin(), points.size());
+}
+
+PointList::PointList(const vector<Point>& points)
+	:
+	data_(inlineData()),
+	size_(0),
+	capacity_(inline_capacity)
+{
+	if (!points.empty())
+		append(&points[0], points.size());
+}
+
+PointList::PointList(const PointList& other)
+	:
+	data_(inlineData()),
+	size_(0),
+	capacity_(inline_capacity)
+{
+	append(other.data_, other.size_);
+}
+
+PointList::PointList(PointList&& other) SVG_NOEXCEPT
+	:
+	data_(inlineData()),
+	size_(0),
+	capacity_(inline_capacity)
+{
+	if (other.isInline()) {
+		append(other.data_, other.size_);
+	} else {
+		data_ = other.data_;
+		size_ = other.size_;
+		capacity_ = other.capacity_;
+		other.data_ = other.inlineData();
+		other.capacity_ = inline_capacity;
+	}
+	other.size_ = 0;
+}
+
+PointList::~PointList()
+{
+	release();
+}
+
+PointList& PointList::operator = (const PointList& other)
+{
+	if (this != &other) {
+		size_ = 0;
+		append(other.data_, other.size_);
+	}
+	return *this;
+}
+
+PointList& PointList::operator = (PointList&& other) SVG_NOEXCEPT
+{
+	if (this == &other)
+		return *this;
+	if (other.isInline()) {
+		size_ = 0;
+		append(other.data_, other.size_);
+	} else {
+		release();
+		data_ = other.data_;
+		size_ = other.size_;
+		capacity_ = other.capacity_;
+		other.data_ = other.inlineData();
+		other.capacity_ = inline_capacity;
+	}
+	other.size_ = 0;
+	return *this;
+}
+
+void PointList::append(const Point* points, size_t count)
+{
+	reserve(size_ + count);
+	if (count)
+		memcpy(data_ + size_, points, count * sizeof(Point));
+	size_ += count;
+}
+
+void PointList::grow(size_t min_capacity)
+{
+	size_t new_capacity = capacity_ * 2;
+	if (new_capacity < min_capacity)
+		new_capacity = min_capacity;
+	Point* new_data = static_cast<Point*>(::operator new(new_capacity * sizeof(Point)));
+	if (size_)
+		memcpy(new_data, data_, size_ * sizeof(Point));
+	release();
+	data_ = new_data;
+	capacity_ = new_capacity;
+}
+
+void PointList::release()
+{
+	if (!isInline())
+		::operator delete(data_);
+}
+
+static optional<Point> getMinPoint(const Point* points, size_t count)
+{
+	if (count == 0)
+		return optional<Point>();
+	Point min = points[0];
+	for (size_t i = 1; i < count; ++i) {
+		auto& pt = points[i];
+		if (pt.x < min.x) min.x = pt.x;
+		if (pt.y < min.y) min.y = pt.y;
+	}
+	return make_optional(min);
+}
+
+static optional<Point> getMaxPoint(const Point* points, size_t count)
+{
+	if (count == 0)
+		return optional<Point>();
+	Point max = points[0];
+	for (size_t i = 1; i < count; ++i) {
+		auto& pt = points[i];
+		if (pt.x > max.x) max.x = pt.x;
+		if (pt.y > max.y) max.y = pt.y;
+	}
+	return make_optional(max);
+}
+
+optional<Point> getMinPoint(const vector<Point>& points)
+{
+	return getMinPoint(points.empty() ? nullptr : &points[0], points.size());
+}
+
+optional<Point> getMaxPoint(const vector<Point>& points)
+{
+	return getMaxPoint(points.empty() ? nullptr : &points[0], points.size());
+}
+
+optional<Point> getMinPoint(const PointList& points)
+{
+	return getMinPoint(points.data(), points.size());
+}
+
+optional<Point> getMaxPoint(const PointList& points)
+{
+	return getMaxPoint(points.data(), points.size());
+}
+
+// Convert coordinates in user space to SVG native space.
+double translateX(double x, const Layout& layout)
+{
+	if (layout.origin == Layout::BottomRight || layout.origin == Layout::TopRight)
+		return layout.dimensions.width - ((x + layout.origin_offset.x) * layout.scale);
+	else
+		return (layout.origin_offset.x + x) * layout.scale;
+}
+
+double translateY(double y, const Layout& layout)
+{
+	if (layout.origin == Layout::BottomLeft || layout.origin == Layout::BottomRight)
+		return layout.dimensions.height - ((y + layout.origin_offset.y) * layout.scale);
+	else
+		return (layout.origin_offset.y + y) * layout.scale;
+}
+
+double translateScale(double dimension, const Layout& layout)
+{
+	return dimension * layout.scale;
+}
+
+Color::Color(Defaults color)
+	:
+	transparent(false),
+	red(0),
+	green(0),
+	blue(0)
+{
+	switch (color) {
+	case Aqua: assign(0, 255, 255); break;
+	case Black: assign(0, 0, 0); break;
+	case Blue: assign(0, 0, 255); break;
+	case Brown: assign(165, 42, 42); break;
+	case Cyan: assign(0, 255, 255); break;
+	case Fuchsia: assign(255, 0, 255); break;
+	case Green: assign(0, 128, 0); break;
+	case Lime: assign(0, 255, 0); break;
+	case Magenta: assign(255, 0, 255); break;
+	case Orange: assign(255, 165, 0); break;
+	case Purple: assign(128, 0, 128); break;
+	case Red: assign(255, 0, 0); break;
+	case Silver: assign(192, 192, 192); break;
+	case White: assign(255, 255, 255); break;
+	case Yellow: assign(255, 255, 0); break;
+	default: transparent = true; break;
+	}
+}
+
+// Colour keywords that are shorter than their hex form.
+static const struct { int rgb; const char* name; } short_color_names[] = {
+	{ 0xd2b48c, "tan" }, { 0xff0000, "red" },
+	{ 0x000080, "navy" }, { 0x808080, "gray" }, { 0x008080, "teal" },
+	{ 0xdda0dd, "plum" }, { 0xcd853f, "peru" }, { 0xfffafa, "snow" },
+	{ 0xffd700, "gold" }, { 0x008000, "green" }, { 0x800000, "maroon" },
+	{ 0x808000, "olive" }, { 0xffa500, "orange" }, { 0x800080, "purple" },
+	{ 0xc0c0c0, "silver" }, { 0xee82ee, "violet" }, { 0xf5deb3, "wheat" },
+	{ 0xfaf0e6, "linen" }, { 0xf0ffff, "azure" }, { 0xf5f5dc, "beige" },
+	{ 0xff7f50, "coral" }, { 0xfffff0, "ivory" }, { 0xf0e68c, "khaki" },
+	{ 0xffe4c4, "bisque" }, { 0xda70d6, "orchid" }, { 0xfa8072, "salmon" },
+	{ 0xa0522d, "sienna" }, { 0xff6347, "tomato" }, { 0xa52a2a, "brown" },
+	{ 0x4b0082, "indigo" },
+};
+
+static void shortestColor(string& s, int red, int green, int blue)
+{
+	int rgb = ((red & 0xFF) << 16) | ((green & 0xFF) << 8) | (blue & 0xFF);
+	for (auto& entry: short_color_names) {
+		if (entry.rgb == rgb) {
+			s += entry.name;
+			return;
+		}
+	}
+	static const char digits[] = "0123456789abcdef";
+	char buf[8];
+	int components[] = { red & 0xFF, green & 0xFF, blue & 0xFF };
+	bool shorthand = true;
+	for (auto c: components) {
+		if ((c >> 4) != (c & 0xF))
+			shorthand = false;
+	}
+	char* p = buf;
+	*p++ = '#';
+	for (auto c: components) {
+		*p++ = digits[c >> 4];
+		if (!shorthand)
+			*p++ = digits[c & 0xF];
+	}
+	s.append(buf, p - buf);
+}
+
+void Color::toString(string& s, const Layout& layout) const
+{
+	if (transparent)
+		s += "transparent";
+	else if (layout.minified())
+		shortestColor(s, red, green, blue);
+	else {
+		s += "rgb(";
+		s += svg::toString(red);
+		s += ",";
+		s += svg::toString(green);
+		s += ",";
+		s += svg::toString(blue);
+		s += ")";
+	}
+}
+
+void Fill::toString(string& s, const Layout& layout) const
+{
+	// Black is the default fill.
+	if (layout.minified() && !color.transparent
+		&& color.red == 0 && color.green == 0 && color.blue == 0)
+		return;
+	attribute(s, "fill", color, layout);
+}
+
+const char* Stroke::toString(Linecap linecap)
+{
+	switch (linecap) {
+	case Linecap::butt: return "butt";
+	case Linecap::round: return "round";
+	case Linecap::square: return "square";
+	default: return "butt";
+	}
+}
+
+void Stroke::toString(string& s, const Layout& layout) const
+{
+	// If stroke width is invalid.
+	if (width < 0)
+		return;
+	attribute(s, "stroke", color, layout);
+	widthToString(s, layout);
+	tailToString(s, layout);
+}
+
+void Stroke::widthToString(string& s, const Layout& layout) const
+{
+	double scaled = translateScale(width, layout);
+	// 1 is the default stroke width.
+	if (layout.minified() && scaled == 1)
+		return;
+	attribute(s, "stroke-width", scaled, layout);
+}
+
+void Stroke::tailToString(string& s, const Layout& layout) const
+{
+	if (linecap && !(layout.minified() && *linecap == Linecap::butt)) {
+		attribute(s, "stroke-linecap", toString(*linecap));
+	}
+	if (!dasharray.empty()) {
+		string tmp;
+		for (size_t i = 0; i < dasharray.size(); ++i) {
+			if (layout.minified()) {
+				if (i)
+					tmp += ",";
+				numberToString(tmp, dasharray[i], layout);
+			} else {
+				tmp += svg::toString(dasharray[i]);
+				tmp += ",";
+			}
+		}
+		attribute(s, "stroke-dasharray", tmp);
+	}
+}
+
+void Font::toString(string& s, const Layout& layout) const
+{
+	attribute(s, "font-size", translateScale(size, layout), layout);
+	attribute(s, "font-family", family);
+}
+
+Style::Style(const Fill& fill, const Stroke& stroke, const Font& font)
+	:
+	fill_(fill),
+	stroke_(stroke),
+	font_(font)
+{ }
+
+void Style::prerender()
+{
+	auto rendered = std::make_shared<Prerendered>();
+	for (int format = Layout::Pretty; format <= Layout::Minified; ++format) {
+		Layout layout;
+		layout.format = Layout::Format(format);
+		Segments& seg = rendered->formats[format];
+		fill_.toString(seg.fill, layout);
+		if (stroke_.width >= 0) {
+			attribute(seg.stroke_color, "stroke", stroke_.color, layout);
+			stroke_.tailToString(seg.stroke_tail, layout);
+		}
+		attribute(seg.font_family, "font-family", font_.family);
+	}
+	prerendered = rendered;
+}
+
+void Style::toString(string& s, const Layout& layout) const
+{
+	fillToString(s, layout);
+	strokeToString(s, layout);
+}
+
+void Style::fillToString(string& s, const Layout& layout) const
+{
+	if (prerendered)
+		s += prerendered->formats[layout.format].fill;
+	else
+		fill_.toString(s, layout);
+}
+
+void Style::strokeToString(string& s, const Layout& layout) const
+{
+	if (!prerendered) {
+		stroke_.toString(s, layout);
+		return;
+	}
+	if (stroke_.width < 0)
+		return;
+	const Segments& seg = prerendered->formats[layout.format];
+	s += seg.stroke_color;
+	stroke_.widthToString(s, layout);
+	s += seg.stroke_tail;
+}
+
+void Style::fontToString(string& s, const Layout& layout) const
+{
+	if (!prerendered) {
+		font_.toString(s, layout);
+		return;
+	}
+	attribute(s, "font-size", translateScale(font_.size, layout), layout);
+	s += prerendered->formats[layout.format].font_family;
+}
+
+static size_t hashCombine(size_t seed, size_t value)
+{
+	return seed ^ (value + 0x9e3779b9 + (seed << 6) + (seed >> 2));
+}
+
+static size_t hashColor(const Color& color)
+{
+	if (color.transparent)
+		return size_t(-1);
+	return (size_t(color.red) << 16) ^ (size_t(color.green) << 8) ^ size_t(color.blue);
+}
+
+static bool sameColor(const Color& a, const Color& b)
+{
+	if (a.transparent || b.transparent)
+		return a.transparent == b.transparent;
+	return a.red == b.red && a.green == b.green && a.blue == b.blue;
+}
+
+size_t Style::hash() const
+{
+	std::hash<double> hash_double;
+	size_t h = hashColor(fill_.color);
+	h = hashCombine(h, hash_double(stroke_.width));
+	h = hashCombine(h, hashColor(stroke_.color));
+	h = hashCombine(h, stroke_.linecap ? size_t(*stroke_.linecap) + 1 : 0);
+	for (auto dash: stroke_.dasharray) {
+		h = hashCombine(h, hash_double(dash));
+	}
+	h = hashCombine(h, hash_double(font_.size));
+	h = hashCombine(h, std::hash<string>()(font_.family));
+	return h;
+}
+
+bool Style::operator == (const Style& other) const
+{
+	if (!sameColor(fill_.color, other.fill_.color)
+		|| stroke_.width != other.stroke_.width
+		|| !sameColor(stroke_.color, other.stroke_.color)
+		|| bool(stroke_.linecap) != bool(other.stroke_.linecap)
+		|| stroke_.dasharray != other.stroke_.dasharray
+		|| font_.size != other.font_.size
+		|| font_.family != other.font_.family)
+		return false;
+	return !stroke_.linecap || *stroke_.linecap == *other.stroke_.linecap;
+}
+
+StyleRef StylePool::get(const Fill& fill, const Stroke& stroke, const Font& font)
+{
+	return get(Style(fill, stroke, font));
+}
+
+StyleRef StylePool::get(const Style& style)
+{
+	size_t h = style.hash();
+	auto range = styles.equal_range(h);
+	for (auto it = range.first; it != range.second; ++it) {
+		if (*it->second == style)
+			return it->second;
+	}
+	auto interned = std::make_shared<Style>(style);
+	interned->prerender();
+	styles.insert(std::make_pair(h, interned));
+	return interned;
+}
+
+void Circle::toString(string& s, const Layout& layout) const
+{
+	toString(s, layout, center, radius, *style);
+}
+
+void Circle::toString(string& s, const Layout& layout,
+	const Point& center, double radius, const Style& style)
+{
+	elemStart(s, "circle", layout);
+	coordinateAttribute(s, "cx", translateX(center.x, layout), layout);
+	coordinateAttribute(s, "cy", translateY(center.y, layout), layout);
+	attribute(s, "r", translateScale(radius, layout), layout);
+	style.toString(s, layout);
+	emptyElemEnd(s, layout);
+}
+
+void Circle::offset(const Point& offset)
+{
+	center += offset;
+}
+
+void Elipse::toString(string& s, const Layout& layout) const
+{
+	toString(s, layout, center, radius_width, radius_height, *style);
+}
+
+void Elipse::toString(string& s, const Layout& layout,
+	const Point& center, double radius_width, double radius_height, const Style& style)
+{
+	elemStart(s, "ellipse", layout);
+	coordinateAttribute(s, "cx", translateX(center.x, layout), layout);
+	coordinateAttribute(s, "cy", translateY(center.y, layout), layout);
+	attribute(s, "rx", translateScale(radius_width, layout), layout);
+	attribute(s, "ry", translateScale(radius_height, layout), layout);
+	style.toString(s, layout);
+	emptyElemEnd(s, layout);
+}
+
+void Elipse::offset(const Point& offset)
+{
+	center += offset;
+}
+
+void Rectangle::toString(string& s, const Layout& layout) const
+{
+	toString(s, layout, edge, width, height, *style);
+}
+
+void Rectangle::toString(string& s, const Layout& layout,
+	const Point& edge, double width, double height, const Style& style)
+{
+	elemStart(s, "rect", layout);
+	coordinateAttribute(s, "x", translateX(edge.x, layout), layout);
+	coordinateAttribute(s, "y", translateY(edge.y, layout), layout);
+	attribute(s, "width", translateScale(width, layout), layout);
+	attribute(s, "height", translateScale(height, layout), layout);
+	style.toString(s, layout);
+	emptyElemEnd(s, layout);
+}
+
+void Rectangle::offset(const Point& offset)
+{
+	edge += offset;
+}
+
+void Line::toString(string& s, const Layout& layout) const
+{
+	toString(s, layout, start_point, end_point, *style);
+}
+
+void Line::toString(string& s, const Layout& layout,
+	const Point& start_point, const Point& end_point, const Style& style)
+{
+	elemStart(s, "line", layout);
+	coordinateAttribute(s, "x1", translateX(start_point.x, layout), layout);
+	coordinateAttribute(s, "y1", translateY(start_point.y, layout), layout);
+	coordinateAttribute(s, "x2", translateX(end_point.x, layout), layout);
+	coordinateAttribute(s, "y2", translateY(end_point.y, layout), layout);
+	style.strokeToString(s, layout);
+	emptyElemEnd(s, layout);
+}
+
+void Line::offset(const Point& offset)
+{
+	start_point += offset;
+	end_point += offset;
+}
+
+// One "x,y" pair of a points attribute.  Pretty output ends every pair with
+// a space, minified output only separates them.
+static void pointToString(string& s, const Point& pt, bool first, const Layout& layout)
+{
+	if (layout.minified() && !first)
+		s += " ";
+	numberToString(s, translateX(pt.x, layout), layout);
+	s += ",";
+	numberToString(s, translateY(pt.y, layout), layout);
+	if (!layout.minified())
+		s += " ";
+}
+
+static void pointsToString(string& s, const char* element_name,
+	const Point* points, size_t count, const Style& style, const Layout& layout)
+{
+	elemStart(s, element_name, layout);
+	s += "points=\"";
+	for (size_t i = 0; i < count; ++i) {
+		pointToString(s, points[i], i == 0, layout);
+	}
+	s += "\" ";
+	style.toString(s, layout);
+	emptyElemEnd(s, layout);
+}
+
+void Polygon::toString(string& s, const Layout& layout) const
+{
+	toString(s, layout, points.data(), points.size(), *style);
+}
+
+void Polygon::toString(string& s, const Layout& layout,
+	const Point* points, size_t count, const Style& style)
+{
+	pointsToString(s, "polygon", points, count, style, layout);
+}
+
+void Polygon::offset(const Point& offset)
+{
+	for (auto& pt: points) {
+		pt += offset;
+	}
+}
+
+void Polyline::toString(string& s, const Layout& layout) const
+{
+	toString(s, layout, points.data(), points.size(), *style);
+}
+
+void Polyline::toString(string& s, const Layout& layout,
+	const Point* points, size_t count, const Style& style)
+{
+	pointsToString(s, "polyline", points, count, style, layout);
+}
+
+void Polyline::offset(const Point& offset)
+{
+	for (auto& pt: points) {
+		pt += offset;
+	}
+}
+
+void Text::toString(string& s, const Layout& layout) const
+{
+	toString(s, layout, origin, content.data(), content.size(), *style);
+}
+
+void Text::toString(string& s, const Layout& layout,
+	const Point& origin, const char* content, size_t length, const Style& style)
+{
+	elemStart(s, "text", layout);
+	coordinateAttribute(s, "x", translateX(origin.x, layout), layout);
+	coordinateAttribute(s, "y", translateY(origin.y, layout), layout);
+	style.toString(s, layout);
+	style.fontToString(s, layout);
+	startTagEnd(s, layout);
+	s.append(content, length);
+	elemEnd(s, "text", layout);
+}
+
+void Text::offset(const Point& offset)
+{
+	origin += offset;
+}
+
+TimeSeries::TimeSeries(size_t capacity, const Stroke& stroke)
+	:
+	style(std::make_shared<Style>(Color::Transparent, stroke)),
+	buffer(capacity ? capacity : 1),
+	head(0),
+	count(0),
+	next_seq(0)
+{
+	Extremum* extrema[] = { &min_x, &min_y, &max_x, &max_y };
+	for (auto e: extrema) {
+		e->seqs.resize(buffer.size());
+		e->head = 0;
+		e->size = 0;
+	}
+}
+
+TimeSeries::TimeSeries(size_t capacity, const StyleRef& style)
+	:
+	TimeSeries(capacity)
+{
+	this->style = style;
+}
+
+void TimeSeries::push(const Point& point)
+{
+	size_t cap = buffer.size();
+	if (count == cap) {
+		unsigned long long oldest = next_seq - count;
+		evict(min_x, oldest);
+		evict(min_y, oldest);
+		evict(max_x, oldest);
+		evict(max_y, oldest);
+		head = (head + 1) % cap;
+		--count;
+	}
+	unsigned long long seq = next_seq++;
+	buffer[seq % cap] = point;
+	++count;
+	track(min_x, seq, false, false);
+	track(min_y, seq, true, false);
+	track(max_x, seq, false, true);
+	track(max_y, seq, true, true);
+}
+
+void TimeSeries::clear()
+{
+	head = next_seq % buffer.size();
+	count = 0;
+	min_x.size = min_y.size = max_x.size = max_y.size = 0;
+}
+
+// Drops samples from the back that can never be the extremum again because
+// the new sample is at least as extreme and will stay in the window longer.
+void TimeSeries::track(Extremum& e, unsigned long long seq, bool use_y, bool is_max)
+{
+	size_t cap = e.seqs.size();
+	const Point& pt = sample(seq);
+	double value = use_y ? pt.y : pt.x;
+	while (e.size) {
+		const Point& back = sample(e.seqs[(e.head + e.size - 1) % cap]);
+		double back_value = use_y ? back.y : back.x;
+		if (is_max ? back_value > value : back_value < value)
+			break;
+		--e.size;
+	}
+	e.seqs[(e.head + e.size) % cap] = seq;
+	++e.size;
+}
+
+void TimeSeries::evict(Extremum& e, unsigned long long seq)
+{
+	if (e.size && e.seqs[e.head] == seq) {
+		e.head = (e.head + 1) % e.seqs.size();
+		--e.size;
+	}
+}
+
+optional<Point> TimeSeries::getMinPoint() const
+{
+	if (empty())
+		return optional<Point>();
+	return make_optional(Point(sample(min_x.seqs[min_x.head]).x, sample(min_y.seqs[min_y.head]).y));
+}
+
+optional<Point> TimeSeries::getMaxPoint() const
+{
+	if (empty())
+		return optional<Point>();
+	return make_optional(Point(sample(max_x.seqs[max_x.head]).x, sample(max_y.seqs[max_y.head]).y));
+}
+
+PointSpan TimeSeries::first() const
+{
+	size_t n = std::min(count, buffer.size() - head);
+	return PointSpan(&buffer[head], n);
+}
+
+PointSpan TimeSeries::second() const
+{
+	size_t n = std::min(count, buffer.size() - head);
+	return PointSpan(&buffer[0], count - n);
+}
+
+PointSourceFactory sampleFunction(const std::function<double (double)>& f,
+	double x0, double x1, size_t count)
+{
+	return [=]() -> PointSource {
+		size_t i = 0;
+		return [=](Point& pt) mutable -> bool {
+			if (i == count)
+				return false;
+			double x = count > 1 ? x0 + (x1 - x0) * i / (count - 1) : x0;
+			pt = Point(x, f(x));
+			++i;
+			return true;
+		};
+	};
+}
+
+bool GeneratedPolyline::getBounds(Point& min, Point& max) const
+{
+	if (min_point && max_point) {
+		min = *min_point;
+		max = *max_point;
+		min += shift;
+		max += shift;
+		return true;
+	}
+	PointSource next = source();
+	Point pt;
+	if (!next(pt))
+		return false;
+	min = max = pt;
+	while (next(pt)) {
+		if (pt.x < min.x) min.x = pt.x;
+		if (pt.y < min.y) min.y = pt.y;
+		if (pt.x > max.x) max.x = pt.x;
+		if (pt.y > max.y) max.y = pt.y;
+	}
+	min += shift;
+	max += shift;
+	return true;
+}
+
+typedef std::function<void (const Point&)> PointCallback;
+typedef std::function<void (const PointCallback&)> EachPoint;
+
+// Writes the points attribute for whatever each_point() feeds to its
+// callback, shifted by the given offset.  s is doc's pending string when doc
+// is given.
+static void pointsAttribute(string& s, const EachPoint& each_point, const Point& shift,
+	const Layout& layout, Document* doc)
+{
+	s += "points=\"";
+	bool first = true;
+	each_point([&](const Point& point) {
+		Point pt = point;
+		pt += shift;
+		pointToString(s, pt, first, layout);
+		first = false;
+		if (doc)
+			doc->commit();
+	});
+	s += "\" ";
+}
+
+static void pullAll(const PointSourceFactory& source, const PointCallback& callback)
+{
+	PointSource next = source();
+	Point pt;
+	while (next(pt))
+		callback(pt);
+}
+
+void GeneratedPolyline::toString(string& s, const Layout& layout) const
+{
+	write(s, layout, nullptr);
+}
+
+void GeneratedPolyline::serialize(Document& doc) const
+{
+	write(doc.pending, doc.layout, &doc);
+	doc.commit();
+}
+
+void GeneratedPolyline::write(string& s, const Layout& layout, Document* doc) const
+{
+	elemStart(s, "polyline", layout);
+	pointsAttribute(s, [&](const PointCallback& callback) {
+		pullAll(source, callback);
+	}, shift, layout, doc);
+	style->toString(s, layout);
+	emptyElemEnd(s, layout);
+}
+
+void GeneratedPolyline::offset(const Point& offset)
+{
+	shift += offset;
+}
+
+LineChart& LineChart::operator << (const Polyline& polyline)
+{
+	if (polyline.points.empty())
+		return *this;
+	polylines.push_back(polyline);
+	return *this;
+}
+
+LineChart& LineChart::operator << (const TimeSeries& series)
+{
+	this->series.push_back(&series);
+	return *this;
+}
+
+LineChart& LineChart::operator << (const GeneratedPolyline& polyline)
+{
+	generated.push_back(polyline);
+	return *this;
+}
+
+// Writes the line through the points that each_point() produces, shifted by
+// the chart margin, followed by a marker for every vertex.  The points are
+// read in place (or pulled twice from a generator), never copied.
+static void seriesToString(string& s, const EachPoint& each_point, const Point& shift,
+	const Style& style, double vertex_diameter, const Layout& layout, Document* doc)
+{
+	elemStart(s, "polyline", layout);
+	pointsAttribute(s, each_point, shift, layout, doc);
+	style.toString(s, layout);
+	emptyElemEnd(s, layout);
+
+	// All vertex markers share one style.
+	Circle vertex(Point(), vertex_diameter, std::make_shared<Style>(Fill(Color::Black)));
+	each_point([&](const Point& pt) {
+		vertex.center = pt;
+		vertex.center += shift;
+		vertex.Circle::toString(s, layout);
+		if (doc)
+			doc->commit();
+	});
+}
+
+static void eachSpanPoint(const PointSpan* spans, size_t span_count, const PointCallback& callback)
+{
+	for (size_t i = 0; i < span_count; ++i) {
+		for (size_t j = 0; j < spans[i].size; ++j)
+			callback(spans[i].data[j]);
+	}
+}
+
+void LineChart::toString(string& s, const Layout& layout) const
+{
+	write(s, layout, nullptr);
+}
+
+void LineChart::serialize(Document& doc) const
+{
+	write(doc.pending, doc.layout, &doc);
+	doc.commit();
+}
+
+void LineChart::write(string& s, const Layout& layout, Document* doc) const
+{
+	optional<Dimensions> dimensions = getDimensions();
+	if (!dimensions)
+		return;
+	Point shift(margin.width, margin.height);
+	double diameter = dimensions->height / 30.0;
+	for (auto& polyline: polylines) {
+		const PointList& points = polyline.points;
+		seriesToString(s, [&](const PointCallback& callback) {
+			for (auto& pt: points)
+				callback(pt);
+		}, shift, *polyline.style, diameter, layout, doc);
+	}
+	for (auto ts: series) {
+		if (ts->empty())
+			continue;
+		PointSpan spans[] = { ts->first(), ts->second() };
+		seriesToString(s, [&](const PointCallback& callback) {
+			eachSpanPoint(spans, 2, callback);
+		}, shift, *ts->style, diameter, layout, doc);
+	}
+	for (auto& polyline: generated) {
+		Point gen_shift = shift;
+		gen_shift += polyline.shift;
+		seriesToString(s, [&](const PointCallback& callback) {
+			pullAll(polyline.source, callback);
+		}, gen_shift, *polyline.style, diameter, layout, doc);
+	}
+	axisString(s, *dimensions, layout);
+}
+
+void LineChart::offset(const Point& offset)
+{
+	for (auto& polyline: polylines) {
+		polyline.offset(offset);
+	}
+	for (auto& polyline: generated) {
+		polyline.offset(offset);
+	}
+}
+
+optional<Dimensions> LineChart::getDimensions() const
+{
+	optional<Point> min;
+	optional<Point> max;
+	auto extend = [&](const optional<Point>& minPt, const optional<Point>& maxPt) {
+		if (!minPt)
+			return;
+		if (!min) {
+			min = minPt;
+			max = maxPt;
+			return;
+		}
+		if (minPt->x < min->x)	min->x = minPt->x;
+		if (minPt->y < min->y)	min->y = minPt->y;
+		if (maxPt->x > max->x)	max->x = maxPt->x;
+		if (maxPt->y > max->y)	max->y = maxPt->y;
+	};
+	for (auto& polyline: polylines) {
+		extend(getMinPoint(polyline.points), getMaxPoint(polyline.points));
+	}
+	for (auto ts: series) {
+		extend(ts->getMinPoint(), ts->getMaxPoint());
+	}
+	for (auto& polyline: generated) {
+		Point minPt, maxPt;
+		if (polyline.getBounds(minPt, maxPt))
+			extend(minPt, maxPt);
+	}
+	if (!min)
+		return optional<Dimensions>();
+
+	return make_optional(Dimensions(max->x - min->x, max->y - min->y));
+}
+
+void LineChart::axisString(string& s, const Layout& layout) const
+{
+	optional<Dimensions> dimensions = getDimensions();
+	if (!dimensions)
+		return;
+	axisString(s, *dimensions, layout);
+}
+
+void LineChart::axisString(string& s, const Dimensions& dimensions, const Layout& layout) const
+{
+	// Make the axis 10% wider and higher than the data points.
+	double width = dimensions.width * 1.1;
+	double height = dimensions.height * 1.1;
+
+	// Draw the axis.
+	Polyline axis(Color::Transparent, axis_stroke);
+	axis << Point(margin.width, margin.height + height)
+		<< Point(margin.width, margin.height)
+		<< Point(margin.width + width, margin.height);
+
+	axis.toString(s, layout);
+}
+
+void LineChart::polylineToString(string& s, const Polyline& polyline, const Layout& layout) const
+{
+	const PointList& points = polyline.points;
+	seriesToString(s, [&](const PointCallback& callback) {
+		for (auto& pt: points)
+			callback(pt);
+	}, Point(margin.width, margin.height), *polyline.style, getDimensions()->height / 30.0, layout, nullptr);
+}
+ColorMap::ColorMap(unsigned levels)
+	:
+	stops({ Color(68, 1, 84), Color(59, 82, 139), Color(33, 145, 140),
+		Color(94, 201, 98), Color(253, 231, 37) }),
+	levels(levels ? levels : 1)
+{ }
+
+ColorMap::ColorMap(initializer_list<Color> stops, unsigned levels)
+	:
+	stops(stops),
+	levels(levels ? levels : 1)
+{ }
+
+Color ColorMap::operator () (double t) const
+{
+	return levelColor(level(t));
+}
+
+unsigned ColorMap::level(double t) const
+{
+	if (!(t > 0))
+		return 0;
+	if (t >= 1)
+		return levels - 1;
+	return static_cast<unsigned>(t * levels);
+}
+
+Color ColorMap::levelColor(unsigned level) const
+{
+	if (stops.empty())
+		return Color::Black;
+	if (stops.size() == 1 || levels == 1)
+		return stops.back();
+	double t = double(level) / (levels - 1) * (stops.size() - 1);
+	size_t i = std::min(static_cast<size_t>(t), stops.size() - 2);
+	double f = t - i;
+	const Color& a = stops[i];
+	const Color& b = stops[i + 1];
+	return Color(
+		int(a.red + (b.red - a.red) * f + .5),
+		int(a.green + (b.green - a.green) * f + .5),
+		int(a.blue + (b.blue - a.blue) * f + .5));
+}
+
+void Heatmap::append(const Point* points, size_t count)
+{
+	this->points.insert(this->points.end(), points, points + count);
+}
+
+void Heatmap::offset(const Point& offset)
+{
+	for (auto& pt: points) {
+		pt += offset;
+	}
+}
+
+// translateX/translateY as x * scale + shift, so the binning loop is a
+// straight multiply-add over the point array.
+static void affineX(const Layout& layout, double& scale, double& shift)
+{
+	scale = layout.scale;
+	shift = layout.origin_offset.x * layout.scale;
+	if (layout.origin == Layout::BottomRight || layout.origin == Layout::TopRight) {
+		scale = -scale;
+		shift = layout.dimensions.width - shift;
+	}
+}
+
+static void affineY(const Layout& layout, double& scale, double& shift)
+{
+	scale = layout.scale;
+	shift = layout.origin_offset.y * layout.scale;
+	if (layout.origin == Layout::BottomLeft || layout.origin == Layout::BottomRight) {
+		scale = -scale;
+		shift = layout.dimensions.height - shift;
+	}
+}
+
+static void binPoints(const Point* points, size_t count,
+	double sx, double bx, double sy, double by,
+	unsigned columns, unsigned rows, unsigned* cells)
+{
+	for (size_t i = 0; i < count; ++i) {
+		double x = points[i].x * sx + bx;
+		double y = points[i].y * sy + by;
+		if (!(x >= 0 && y >= 0 && x <= columns && y <= rows))
+			continue;
+		// The far edges belong to the last cell; in bottom-origin layouts
+		// that is where points on the axis land.
+		unsigned cx = std::min(unsigned(x), columns - 1);
+		unsigned cy = std::min(unsigned(y), rows - 1);
+		++cells[cy * columns + cx];
+	}
+}
+
+vector<unsigned> Heatmap::bin(const Layout& layout, unsigned& columns, unsigned& rows) const
+{
+	double cell = cell_size > 0 ? cell_size : 1;
+	columns = static_cast<unsigned>(std::ceil(layout.dimensions.width / cell));
+	rows = static_cast<unsigned>(std::ceil(layout.dimensions.height / cell));
+	size_t cell_count = size_t(columns) * rows;
+	vector<unsigned> cells(cell_count);
+	if (!cell_count || points.empty())
+		return cells;
+
+	// Work in cell units directly.
+	double sx, bx, sy, by;
+	affineX(layout, sx, bx);
+	affineY(layout, sy, by);
+	sx /= cell; bx /= cell;
+	sy /= cell; by /= cell;
+
+	// Small inputs aren't worth a thread start, and each extra thread needs
+	// its own grid.
+	const size_t min_points_per_thread = 1 << 16;
+	unsigned thread_count = threads ? threads : std::thread::hardware_concurrency();
+	thread_count = static_cast<unsigned>(std::min<size_t>(
+		std::max(thread_count, 1u), points.size() / min_points_per_thread + 1));
+
+	if (thread_count == 1) {
+		binPoints(&points[0], points.size(), sx, bx, sy, by, columns, rows, &cells[0]);
+		return cells;
+	}
+
+	vector<vector<unsigned>> partial(thread_count - 1, vector<unsigned>(cell_count));
+	vector<std::thread> workers;
+	size_t chunk = (points.size() + thread_count - 1) / thread_count;
+	for (unsigned t = 1; t < thread_count; ++t) {
+		size_t begin = std::min(points.size(), t * chunk);
+		size_t end = std::min(points.size(), begin + chunk);
+		workers.emplace_back(binPoints, &points[0] + begin, end - begin,
+			sx, bx, sy, by, columns, rows, &partial[t - 1][0]);
+	}
+	binPoints(&points[0], std::min(points.size(), chunk), sx, bx, sy, by, columns, rows, &cells[0]);
+	for (auto& worker: workers) {
+		worker.join();
+	}
+	for (auto& grid: partial) {
+		for (size_t i = 0; i < cell_count; ++i) {
+			cells[i] += grid[i];
+		}
+	}
+	return cells;
+}
+
+void Heatmap::toString(string& s, const Layout& layout) const
+{
+	write(s, layout, nullptr);
+}
+
+void Heatmap::serialize(Document& doc) const
+{
+	write(doc.pending, doc.layout, &doc);
+	doc.commit();
+}
+
+void Heatmap::write(string& s, const Layout& layout, Document* doc) const
+{
+	unsigned columns, rows;
+	vector<unsigned> cells = bin(layout, columns, rows);
+	unsigned max_count = 0;
+	for (auto n: cells) {
+		if (n > max_count) max_count = n;
+	}
+	if (!max_count)
+		return;
+
+	double cell = cell_size > 0 ? cell_size : 1;
+	vector<string> fills(color_map.levels);
+	for (unsigned y = 0; y < rows; ++y) {
+		const unsigned* row = &cells[size_t(y) * columns];
+		unsigned x = 0;
+		while (x < columns) {
+			if (!row[x]) {
+				++x;
+				continue;
+			}
+			unsigned level = color_map.level(double(row[x]) / max_count);
+			unsigned run = x + 1;
+			while (run < columns && row[run]
+				&& color_map.level(double(row[run]) / max_count) == level)
+				++run;
+
+			// Cells are already in device space.
+			string& fill = fills[level];
+			if (fill.empty())
+				Fill(color_map.levelColor(level)).toString(fill, layout);
+			elemStart(s, "rect", layout);
+			coordinateAttribute(s, "x", x * cell, layout);
+			coordinateAttribute(s, "y", y * cell, layout);
+			attribute(s, "width", (run - x) * cell, layout);
+			attribute(s, "height", cell, layout);
+			s += fill;
+			emptyElemEnd(s, layout);
+			x = run;
+		}
+		if (doc)
+			doc->commit();
+	}
+}
+
+// Advance widths of the printable ASCII characters (space to '~'), in
+// thousandths of an em.
+static const unsigned short verdana_advances[95] = {
+	352, 394, 459, 818, 636, 1076, 727, 269, 454, 454, 636, 818, 364, 454, 364, 454,
+	636, 636, 636, 636, 636, 636, 636, 636, 636, 636, 454, 454, 818, 818, 818, 545,
+	1000, 684, 686, 698, 771, 632, 575, 775, 751, 421, 455, 693, 557, 843, 748, 787,
+	603, 787, 695, 684, 616, 732, 684, 989, 685, 615, 685, 454, 454, 454, 818, 636,
+	636, 601, 623, 521, 623, 596, 352, 623, 633, 274, 344, 592, 274, 973, 633, 607,
+	623, 623, 427, 521, 394, 633, 592, 818, 592, 592, 525, 635, 454, 635, 818
+};
+
+static const unsigned short helvetica_advances[95] = {
+	278, 278, 355, 556, 556, 889, 667, 191, 333, 333, 389, 584, 278, 333, 278, 278,
+	556, 556, 556, 556, 556, 556, 556, 556, 556, 556, 278, 278, 584, 584, 584, 556,
+	1015, 667, 667, 722, 722, 667, 611, 778, 722, 278, 500, 667, 556, 833, 722, 778,
+	667, 778, 722, 667, 611, 722, 667, 944, 667, 667, 611, 278, 278, 278, 469, 556,
+	333, 556, 556, 500, 556, 556, 278, 556, 556, 222, 222, 500, 222, 833, 556, 556,
+	556, 556, 333, 500, 278, 556, 500, 722, 500, 500, 500, 334, 260, 334, 584
+};
+
+static const unsigned short times_advances[95] = {
+	250, 333, 408, 500, 500, 833, 778, 180, 333, 333, 500, 564, 250, 333, 250, 278,
+	500, 500, 500, 500, 500, 500, 500, 500, 500, 500, 278, 278, 564, 564, 564, 444,
+	921, 722, 667, 667, 722, 611, 556, 722, 722, 333, 389, 722, 611, 889, 722, 722,
+	556, 722, 667, 556, 611, 722, 722, 944, 722, 722, 611, 333, 278, 333, 469, 500,
+	333, 444, 500, 444, 500, 444, 333, 500, 500, 278, 278, 500, 278, 778, 500, 500,
+	500, 500, 333, 389, 278, 500, 500, 722, 500, 500, 444, 480, 200, 480, 541
+};
+
+// Monospaced families have no table, every character is fixed wide.
+struct GlyphTable
+{
+	const unsigned short* advances;
+	unsigned fixed;
+};
+
+// Picks a table by the first family in a CSS family list.
+static GlyphTable glyphTable(const string& family)
+{
+	string name;
+	for (char c: family) {
+		if (c == ',')
+			break;
+		if (c != '"' && c != '\'' && c != ' ')
+			name += static_cast<char>(tolower(static_cast<unsigned char>(c)));
+	}
+	GlyphTable table = { verdana_advances, 636 };
+	if (name.find("mono") != string::npos || name.find("courier") != string::npos) {
+		table.advances = nullptr;
+		table.fixed = 600;
+	} else if (name.find("times") != string::npos || name.find("georgia") != string::npos
+		|| name == "serif") {
+		table.advances = times_advances;
+		table.fixed = 500;
+	} else if (name.find("arial") != string::npos || name.find("helvetica") != string::npos
+		|| name.find("sans") != string::npos) {
+		table.advances = helvetica_advances;
+		table.fixed = 556;
+	}
+	return table;
+}
+
+static double textWidth(const string& content, const GlyphTable& table)
+{
+	unsigned em = 0;
+	for (unsigned char c: content) {
+		if (table.advances && c >= 32 && c < 127)
+			em += table.advances[c - 32];
+		else if ((c & 0xC0) != 0x80)
+			em += table.fixed;
+	}
+	return em / 1000.0;
+}
+
+double textWidth(const string& content, const Font& font)
+{
+	return textWidth(content, glyphTable(font.family)) * font.size;
+}
+
+// Share of the font size a line of text reaches above and below its baseline.
+static const double label_ascent = 0.9;
+static const double label_descent = 0.25;
+
+struct LabelBox
+{
+	float x0, y0, x1, y1;
+
+	bool overlaps(const LabelBox& other) const
+	{
+		return x0 < other.x1 && other.x0 < x1 && y0 < other.y1 && other.y0 < y1;
+	}
+};
+
+vector<size_t> LabelLayer::visible(const Layout& layout) const
+{
+	size_t count = labels.size();
+	vector<LabelBox> boxes(count);
+	const Style* last_style = nullptr;
+	GlyphTable table = { nullptr, 0 };
+	double total_extent = 0;
+	float pad = static_cast<float>(padding / 2);
+	for (size_t i = 0; i < count; ++i) {
+		const Text& label = labels[i];
+		if (label.style.get() != last_style) {
+			last_style = label.style.get();
+			table = glyphTable(label.font().family);
+		}
+		double size = translateScale(label.font().size, layout);
+		double x = translateX(label.origin.x, layout);
+		double y = translateY(label.origin.y, layout);
+		double width = textWidth(label.content, table) * size;
+		LabelBox& box = boxes[i];
+		box.x0 = static_cast<float>(x) - pad;
+		box.x1 = static_cast<float>(x + width) + pad;
+		box.y0 = static_cast<float>(y - size * label_ascent) - pad;
+		box.y1 = static_cast<float>(y + size * label_descent) + pad;
+		total_extent += std::max(box.x1 - box.x0, box.y1 - box.y0);
+	}
+
+	vector<size_t> order(count);
+	for (size_t i = 0; i < count; ++i)
+		order[i] = i;
+	if (count > 1 && !std::equal(priorities.begin() + 1, priorities.end(), priorities.begin())) {
+		std::stable_sort(order.begin(), order.end(), [&](size_t a, size_t b) {
+			return priorities[a] > priorities[b];
+		});
+	}
+
+	// Cells about as large as a typical label, so a label spans a few cells
+	// and a cell holds a few labels.
+	double cell = count ? std::max(total_extent / count, 1.0) : 1.0;
+	double inv_cell = 1 / cell;
+	size_t buckets = 1024;
+	while (buckets < 2 * count)
+		buckets *= 2;
+	size_t mask = buckets - 1;
+	// Each bucket heads a list of the placed labels touching the cells that
+	// hash to it.
+	vector<int> heads(buckets, -1);
+	struct Node
+	{
+		unsigned label;
+		int next;
+	};
+	vector<Node> nodes;
+	nodes.reserve(count);
+	auto bucket = [&](long long cx, long long cy) -> size_t {
+		return static_cast<size_t>((cx * 73856093LL) ^ (cy * 19349663LL)) & mask;
+	};
+
+	vector<char> placed(count, 0);
+	for (auto i: order) {
+		const LabelBox& box = boxes[i];
+		long long cx0 = static_cast<long long>(std::floor(box.x0 * inv_cell));
+		long long cx1 = static_cast<long long>(std::floor(box.x1 * inv_cell));
+		long long cy0 = static_cast<long long>(std::floor(box.y0 * inv_cell));
+		long long cy1 = static_cast<long long>(std::floor(box.y1 * inv_cell));
+		bool collides = false;
+		for (long long cy = cy0; cy <= cy1 && !collides; ++cy) {
+			for (long long cx = cx0; cx <= cx1 && !collides; ++cx) {
+				for (int n = heads[bucket(cx, cy)]; n >= 0; n = nodes[n].next) {
+					if (boxes[nodes[n].label].overlaps(box)) {
+						collides = true;
+						break;
+					}
+				}
+			}
+		}
+		if (collides)
+			continue;
+		placed[i] = 1;
+		for (long long cy = cy0; cy <= cy1; ++cy) {
+			for (long long cx = cx0; cx <= cx1; ++cx) {
+				size_t b = bucket(cx, cy);
+				Node node = { static_cast<unsigned>(i), heads[b] };
+				heads[b] = static_cast<int>(nodes.size());
+				nodes.push_back(node);
+			}
+		}
+	}
+
+	vector<size_t> result;
+	for (size_t i = 0; i < count; ++i) {
+		if (placed[i])
+			result.push_back(i);
+	}
+	return result;
+}
+
+void LabelLayer::toString(string& s, const Layout& layout) const
+{
+	write(s, layout, nullptr);
+}
+
+void LabelLayer::serialize(Document& doc) const
+{
+	write(doc.pending, doc.layout, &doc);
+	doc.commit();
+}
+
+void LabelLayer::write(string& s, const Layout& layout, Document* doc) const
+{
+	for (auto i: visible(layout)) {
+		labels[i].Text::toString(s, layout);
+		if (doc)
+			doc->commit();
+	}
+}
+
+void LabelLayer::offset(const Point& offset)
+{
+	for (auto& label: labels)
+		label.Text::offset(offset);
+}
+
+void ShapeList::clear()
+{
+	order.clear();
+	circles.clear();
+	elipses.clear();
+	rectangles.clear();
+	lines.clear();
+	polygons.clear();
+	polylines.clear();
+	texts.clear();
+}
+
+// The qualified calls below bypass the vtable so the compiler can inline the
+// concrete serializers.
+void ShapeList::toString(string& s, const Layout& layout) const
+{
+	for (auto& entry: order) {
+		toString(entry, s, layout);
+	}
+}
+
+void ShapeList::toString(const Entry& entry, string& s, const Layout& layout) const
+{
+	switch (entry.type) {
+	case CircleType: circles[entry.index].Circle::toString(s, layout); break;
+	case ElipseType: elipses[entry.index].Elipse::toString(s, layout); break;
+	case RectangleType: rectangles[entry.index].Rectangle::toString(s, layout); break;
+	case LineType: lines[entry.index].Line::toString(s, layout); break;
+	case PolygonType: polygons[entry.index].Polygon::toString(s, layout); break;
+	case PolylineType: polylines[entry.index].Polyline::toString(s, layout); break;
+	case TextType: texts[entry.index].Text::toString(s, layout); break;
+	}
+}
+
+void ShapeList::toStringByType(string& s, const Layout& layout) const
+{
+	for (auto& circle: circles) circle.Circle::toString(s, layout);
+	for (auto& elipse: elipses) elipse.Elipse::toString(s, layout);
+	for (auto& rectangle: rectangles) rectangle.Rectangle::toString(s, layout);
+	for (auto& line: lines) line.Line::toString(s, layout);
+	for (auto& polygon: polygons) polygon.Polygon::toString(s, layout);
+	for (auto& polyline: polylines) polyline.Polyline::toString(s, layout);
+	for (auto& text: texts) text.Text::toString(s, layout);
+}
+
+void ShapeList::offset(const Point& offset)
+{
+	for (auto& circle: circles) circle.Circle::offset(offset);
+	for (auto& elipse: elipses) elipse.Elipse::offset(offset);
+	for (auto& rectangle: rectangles) rectangle.Rectangle::offset(offset);
+	for (auto& line: lines) line.Line::offset(offset);
+	for (auto& polygon: polygons) polygon.Polygon::offset(offset);
+	for (auto& polyline: polylines) polyline.Polyline::offset(offset);
+	for (auto& text: texts) text.Text::offset(offset);
+}
+
+// 64-bit FNV-1a, continued from h.
+static uint64_t fnv1a(uint64_t h, const void* data, size_t size)
+{
+	const unsigned char* bytes = static_cast<const unsigned char*>(data);
+	for (size_t i = 0; i < size; ++i) {
+		h ^= bytes[i];
+		h *= 1099511628211ULL;
+	}
+	return h;
+}
+
+namespace {
+
+// Feeds the fields of a scene into fnv1a.  Styles are hashed by their
+// rendered attributes, once per distinct Style.
+struct SceneHasher
+{
+	SceneHasher(const Layout& layout) : layout(layout), h(14695981039346656037ULL) { }
+
+	void add(const void* data, size_t size) { h = fnv1a(h, data, size); }
+	void add(double value) { add(&value, sizeof(value)); }
+	void add(int value) { add(&value, sizeof(value)); }
+	void add(const Point& point)
+	{
+		add(point.x);
+		add(point.y);
+	}
+	void add(const PointList& points)
+	{
+		uint64_t count = points.size();
+		add(&count, sizeof(count));
+		for (auto& pt: points)
+			add(pt);
+	}
+	void add(const string& text)
+	{
+		uint64_t length = text.size();
+		add(&length, sizeof(length));
+		add(text.data(), text.size());
+	}
+	void add(const Style& style)
+	{
+		auto it = styles.find(&style);
+		if (it == styles.end()) {
+			string attributes;
+			style.toString(attributes, layout);
+			style.fontToString(attributes, layout);
+			it = styles.insert(std::make_pair(&style, fnv1a(14695981039346656037ULL,
+				attributes.data(), attributes.size()))).first;
+		}
+		add(&it->second, sizeof(it->second));
+	}
+
+	const Layout& layout;
+	uint64_t h;
+	std::unordered_map<const Style*, uint64_t> styles;
+};
+
+} // namespace
+
+uint64_t ShapeList::hash(const Document& doc) const
+{
+	const Layout& layout = doc.layout;
+	SceneHasher hasher(layout);
+	hasher.add(layout.dimensions.width);
+	hasher.add(layout.dimensions.height);
+	hasher.add(layout.scale);
+	hasher.add(static_cast<int>(layout.origin));
+	hasher.add(layout.origin_offset);
+	hasher.add(static_cast<int>(layout.format));
+	hasher.add(static_cast<int>(doc.merge_shapes));
+	for (auto& entry: order) {
+		hasher.add(static_cast<int>(entry.type));
+		switch (entry.type) {
+		case CircleType: {
+			const Circle& circle = circles[entry.index];
+			hasher.add(circle.center);
+			hasher.add(circle.radius);
+			hasher.add(*circle.style);
+			break;
+		}
+		case ElipseType: {
+			const Elipse& elipse = elipses[entry.index];
+			hasher.add(elipse.center);
+			hasher.add(elipse.radius_width);
+			hasher.add(elipse.radius_height);
+			hasher.add(*elipse.style);
+			break;
+		}
+		case RectangleType: {
+			const Rectangle& rectangle = rectangles[entry.index];
+			hasher.add(rectangle.edge);
+			hasher.add(rectangle.width);
+			hasher.add(rectangle.height);
+			hasher.add(*rectangle.style);
+			break;
+		}
+		case LineType: {
+			const Line& line = lines[entry.index];
+			hasher.add(line.start_point);
+			hasher.add(line.end_point);
+			hasher.add(*line.style);
+			break;
+		}
+		case PolygonType:
+			hasher.add(polygons[entry.index].points);
+			hasher.add(*polygons[entry.index].style);
+			break;
+		case PolylineType:
+			hasher.add(polylines[entry.index].points);
+			hasher.add(*polylines[entry.index].style);
+			break;
+		case TextType:
+			hasher.add(texts[entry.index].origin);
+			hasher.add(texts[entry.index].content);
+			hasher.add(*texts[entry.index].style);
+			break;
+		}
+	}
+	return hasher.h;
+}
+
+BlockPool::~BlockPool()
+{
+	for (auto block: free_blocks) {
+		delete[] block;
+	}
+}
+
+char* BlockPool::acquire()
+{
+	{
+		std::lock_guard<std::mutex> lock(mutex);
+		if (!free_blocks.empty()) {
+			char* block = free_blocks.back();
+			free_blocks.pop_back();
+			return block;
+		}
+	}
+	return new char[block_size];
+}
+
+void BlockPool::release(char* block)
+{
+	{
+		std::lock_guard<std::mutex> lock(mutex);
+		if (free_blocks.size() < max_free) {
+			free_blocks.push_back(block);
+			return;
+		}
+	}
+	delete[] block;
+}
+
+// Namespace scope rather than a function static: VS2013 doesn't make the
+// initialization of local statics thread-safe.
+static BlockPool shared_pool;
+
+BlockPool& BlockPool::shared()
+{
+	return shared_pool;
+}
+
+OutputBuffer::OutputBuffer(const OutputBuffer& other)
+	:
+	pool(other.pool),
+	total(0)
+{
+	for (auto& block: other.chain) {
+		append(block.data, block.size);
+	}
+}
+
+OutputBuffer::OutputBuffer(OutputBuffer&& other)
+	:
+	pool(other.pool),
+	total(other.total)
+{
+	chain.swap(other.chain);
+	other.total = 0;
+}
+
+OutputBuffer& OutputBuffer::operator = (OutputBuffer other)
+{
+	swap(*this, other);
+	return *this;
+}
+
+void swap(OutputBuffer& a, OutputBuffer& b)
+{
+	std::swap(a.pool, b.pool);
+	a.chain.swap(b.chain);
+	std::swap(a.total, b.total);
+}
+
+void OutputBuffer::append(const char* data, size_t size)
+{
+	while (size > 0) {
+		if (chain.empty() || chain.back().size == BlockPool::block_size) {
+			chain.push_back(Block(pool->acquire(), 0));
+		}
+		Block& last = chain.back();
+		size_t n = std::min<size_t>(size, BlockPool::block_size - last.size);
+		memcpy(last.data + last.size, data, n);
+		last.size += n;
+		total += n;
+		data += n;
+		size -= n;
+	}
+}
+
+void OutputBuffer::clear()
+{
+	for (auto& block: chain) {
+		pool->release(block.data);
+	}
+	chain.clear();
+	total = 0;
+}
+
+void OutputBuffer::toString(string& s) const
+{
+	s.reserve(s.size() + total);
+	for (auto& block: chain) {
+		s.append(block.data, block.size);
+	}
+}
+
+void Shape::serialize(Document& doc) const
+{
+	toString(doc.pending, doc.layout);
+	doc.commit();
+}
+
+Document& Document::operator << (const ShapeList& shapes)
+{
+	for (auto& entry: shapes.order) {
+		add(shapes, entry);
+	}
+	return *this;
+}
+
+Document& Document::add(const ShapeList& shapes, const ShapeList::Entry& entry)
+{
+	if (merge_shapes) {
+		switch (entry.type) {
+		case ShapeList::CircleType:
+			return *this << shapes.circles[entry.index];
+		case ShapeList::ElipseType:
+			return *this << shapes.elipses[entry.index];
+		case ShapeList::RectangleType:
+			return *this << shapes.rectangles[entry.index];
+		default:
+			break;
+		}
+	}
+	// A run may be left over from while merge_shapes was set.
+	endRun();
+	shapes.toString(entry, pending, layout);
+	commit();
+	return *this;
+}
+
+// Appends a path command and its arguments.  Minified data leaves out the
+// separators that a command letter or a minus sign already provides.
+static void pathCommand(string& d, char command, const double* values, size_t count, const Layout& layout)
+{
+	if (!layout.minified() && !d.empty())
+		d += ' ';
+	d += command;
+	for (size_t i = 0; i < count; ++i) {
+		if (i > 0)
+			d += ' ';
+		size_t mark = d.size();
+		numberToString(d, values[i], layout);
+		if (layout.minified() && i > 0 && d[mark] == '-')
+			d.erase(mark - 1, 1);
+	}
+}
+
+// Starts a subpath at device point to.  After the first subpath the move is
+// relative to the start of the previous one, where its z left the current
+// point, whenever that is the shorter form.  Both forms are written into d
+// and the longer one is cut off again.
+static void pathMove(string& d, const Point& to, Point& start, bool first, const Layout& layout)
+{
+	double absolute[] = { to.x, to.y };
+	double relative[] = { to.x - start.x, to.y - start.y };
+	start = to;
+	size_t mark = d.size();
+	pathCommand(d, 'M', absolute, 2, layout);
+	if (first)
+		return;
+	size_t middle = d.size();
+	pathCommand(d, 'm', relative, 2, layout);
+	if (d.size() - middle < middle - mark)
+		d.erase(mark, middle - mark);
+	else
+		d.resize(middle);
+}
+
+// Every subpath runs clockwise on screen, so overlapping shapes add up
+// under the nonzero fill rule instead of cutting holes in each other.
+static void subpath(string& d, const Rectangle& rectangle, bool first, Point& start,
+	string&, Point&, const Layout& layout)
+{
+	Point edge(translateX(rectangle.edge.x, layout), translateY(rectangle.edge.y, layout));
+	double width = translateScale(rectangle.width, layout);
+	double height = translateScale(rectangle.height, layout);
+	double back = -width;
+	pathMove(d, edge, start, first, layout);
+	pathCommand(d, 'h', &width, 1, layout);
+	pathCommand(d, 'v', &height, 1, layout);
+	pathCommand(d, 'h', &back, 1, layout);
+	pathCommand(d, 'z', nullptr, 0, layout);
+}
+
+// Two half-ellipse arcs from the leftmost point, over the top and back
+// underneath.  Markers in a run tend to share their radii, so the arcs are
+// only formatted again when those change.
+static void arcSubpath(string& d, const Point& center, double rx, double ry,
+	bool first, Point& start, string& arcs, Point& radii, const Layout& layout)
+{
+	Point cx(translateX(center.x, layout), translateY(center.y, layout));
+	rx = translateScale(rx, layout);
+	ry = translateScale(ry, layout);
+	pathMove(d, Point(cx.x - rx, cx.y), start, first, layout);
+	if (arcs.empty() || radii.x != rx || radii.y != ry) {
+		arcs.clear();
+		radii = Point(rx, ry);
+		double arc[] = { rx, ry, 0, 1, 1, 2 * rx, 0 };
+		pathCommand(arcs, 'a', arc, 7, layout);
+		arc[5] = -2 * rx;
+		pathCommand(arcs, 'a', arc, 7, layout);
+		pathCommand(arcs, 'z', nullptr, 0, layout);
+	}
+	if (!layout.minified())
+		d += ' ';
+	d += arcs;
+}
+
+static void subpath(string& d, const Circle& circle, bool first, Point& start,
+	string& arcs, Point& radii, const Layout& layout)
+{
+	arcSubpath(d, circle.center, circle.radius, circle.radius, first, start, arcs, radii, layout);
+}
+
+static void subpath(string& d, const Elipse& elipse, bool first, Point& start,
+	string& arcs, Point& radii, const Layout& layout)
+{
+	arcSubpath(d, elipse.center, elipse.radius_width, elipse.radius_height, first, start, arcs, radii, layout);
+}
+
+template <typename T>
+void Document::extendRun(const T& shape)
+{
+	// Shapes built from a Fill and Stroke each own an equal but separate
+	// Style, so compare by value when the pointers differ.
+	if (run_length && run_style != shape.style.get() && !(*run_style == *shape.style))
+		writeRun();
+	if (!run_length) {
+		run << shape;
+		run_style = shape.style.get();
+	}
+	subpath(run_path, shape, run_length == 0, run_start, run_arcs, run_radii, layout);
+	++run_length;
+	// A long run continues in a new path rather than growing the path data
+	// without bound, so it reaches the blocks a block's worth at a time.
+	if (run_path.size() >= BlockPool::block_size)
+		writeRun();
+}
+
+// Shapes with no area are written as they are: a path would still draw their
+// stroke, the element doesn't render at all.
+Document& Document::operator << (const Circle& circle)
+{
+	if (!merge_shapes || !(circle.radius > 0))
+		return *this << static_cast<const Shape&>(circle);
+	extendRun(circle);
+	return *this;
+}
+
+Document& Document::operator << (const Elipse& elipse)
+{
+	if (!merge_shapes || !(elipse.radius_width > 0 && elipse.radius_height > 0))
+		return *this << static_cast<const Shape&>(elipse);
+	extendRun(elipse);
+	return *this;
+}
+
+Document& Document::operator << (const Rectangle& rectangle)
+{
+	if (!merge_shapes || !(rectangle.width > 0 && rectangle.height > 0))
+		return *this << static_cast<const Shape&>(rectangle);
+	extendRun(rectangle);
+	return *this;
+}
+
+void Document::runToString(string& s) const
+{
+	if (run_length == 1) {
+		run.toString(s, layout);
+	} else if (run_length > 1) {
+		elemStart(s, "path", layout);
+		s += "d=\"";
+		s += run_path;
+		s += "\" ";
+		run_style->toString(s, layout);
+		emptyElemEnd(s, layout);
+	}
+}
+
+void Document::writeRun()
+{
+	runToString(pending);
+	run.clear();
+	run_path.clear();
+	run_length = 0;
+	run_style = nullptr;
+	commit();
+}
+
+void Document::prologue(string& s) const
+{
+	if (preamble) {
+		s += *preamble;
+		return;
+	}
+	if (layout.minified()) {
+		s += "<svg ";
+		attribute(s, "width", layout.dimensions.width, layout);
+		attribute(s, "height", layout.dimensions.height, layout);
+		attribute(s, "xmlns", "http://www.w3.org/2000/svg");
+		startTagEnd(s, layout);
+		return;
+	}
+	s += "<?xml ";
+	attribute(s, "version", "1.0");
+	attribute(s, "standalone", "no");
+	s += "?>\n<!DOCTYPE svg PUBLIC \"-//W3C//DTD SVG 1.1//EN\" ";
+	s += "\"http://www.w3.org/Graphics/SVG/1.1/DTD/svg11.dtd\">\n<svg ";
+	attribute(s, "width", layout.dimensions.width, "px");
+	attribute(s, "height", layout.dimensions.height, "px");
+	attribute(s, "xmlns", "http://www.w3.org/2000/svg");
+	attribute(s, "version", "1.1");
+	s += ">\n";
+}
+
+void Document::epilogue(string& s) const
+{
+	elemEnd(s, "svg", layout);
+}
+
+void Document::freeze()
+{
+	if (!preamble) {
+		string head;
+		prologue(head);
+		preamble = std::make_shared<const string>(std::move(head));
+	}
+	flush();
+	if (!body.empty()) {
+		frames.push_back(std::make_shared<const OutputBuffer>(std::move(body)));
+		body.clear();
+	}
+}
+
+void Document::flush()
+{
+	endRun();
+	digest = fnv1a(digest, pending.data(), pending.size());
+	body.append(pending);
+	pending.clear();
+}
+
+uint64_t Document::hash() const
+{
+	string run, head, tail;
+	runToString(run);
+	prologue(head);
+	epilogue(tail);
+	// Hashed in the order a later flush() would see the run, so the hash
+	// only depends on the output.
+	uint64_t h = fnv1a(digest, pending.data(), pending.size());
+	h = fnv1a(h, run.data(), run.size());
+	h = fnv1a(h, head.data(), head.size());
+	return fnv1a(h, tail.data(), tail.size());
+}
+
+size_t Document::size() const
+{
+	string head, tail;
+	prologue(head);
+	runToString(tail);
+	epilogue(tail);
+	size_t size = head.size() + body.size() + pending.size() + tail.size();
+	for (auto& frame: frames) {
+		size += frame->size();
+	}
+	return size;
+}
+
+Document Document::clone(const string& file_name) const
+{
+	Document doc(*this);
+	doc.file_name = file_name;
+	return doc;
+}
+
+void Document::toString(string& s) const
+{
+	size_t size = body.size() + pending.size();
+	for (auto& frame: frames) {
+		size += frame->size();
+	}
+	prologue(s);
+	s.reserve(s.size() + size + 16);
+	for (auto& frame: frames) {
+		frame->toString(s);
+	}
+	body.toString(s);
+	s += pending;
+	runToString(s);
+	epilogue(s);
+}
+
+// Lists head, the frames, body, pending and tail in output order.
+void Document::gather(vector<OutputBuffer::Block>& parts, const string& head, const string& tail) const
+{
+	parts.push_back(OutputBuffer::Block(const_cast<char*>(head.data()), head.size()));
+	for (auto& frame: frames) {
+		parts.insert(parts.end(), frame->blocks().begin(), frame->blocks().end());
+	}
+	parts.insert(parts.end(), body.blocks().begin(), body.blocks().end());
+	parts.push_back(OutputBuffer::Block(const_cast<char*>(pending.data()), pending.size()));
+	parts.push_back(OutputBuffer::Block(const_cast<char*>(tail.data()), tail.size()));
+}
+
+#ifndef _WIN32
+// Writes all of parts, IOV_MAX at a time, resuming after short writes.
+static bool writeAll(int fd, vector<struct iovec>& parts)
+{
+	size_t first = 0;
+	while (first < parts.size()) {
+		int count = static_cast<int>(std::min<size_t>(parts.size() - first, IOV_MAX));
+		ssize_t written = writev(fd, &parts[first], count);
+		if (written < 0) {
+			if (errno == EINTR) {
+				continue;
+			}
+			return false;
+		}
+		size_t left = static_cast<size_t>(written);
+		while (first < parts.size() && left >= parts[first].iov_len) {
+			left -= parts[first].iov_len;
+			++first;
+		}
+		if (left > 0) {
+			parts[first].iov_base = static_cast<char*>(parts[first].iov_base) + left;
+			parts[first].iov_len -= left;
+		}
+	}
+	return true;
+}
+#endif
+
+bool Document::save() const
+{
+	string head, tail;
+	prologue(head);
+	runToString(tail);
+	epilogue(tail);
+
+	vector<OutputBuffer::Block> parts;
+	gather(parts, head, tail);
+
+#ifdef _WIN32
+	FILE* f = fopen(file_name.c_str(), "wb");
+	if (!f) {
+		return false;
+	}
+	bool ok = true;
+	for (auto& part: parts) {
+		ok = ok && fwrite(part.data, 1, part.size, f) == part.size;
+	}
+	return fclose(f) == 0 && ok;
+#else
+	int fd = open(file_name.c_str(), O_WRONLY | O_CREAT | O_TRUNC, 0666);
+	if (fd < 0) {
+		return false;
+	}
+	vector<struct iovec> iov(parts.size());
+	for (size_t i = 0; i < parts.size(); ++i) {
+		iov[i].iov_base = parts[i].data;
+		iov[i].iov_len = parts[i].size;
+	}
+	bool ok = writeAll(fd, iov);
+	return close(fd) == 0 && ok;
+#endif
+}
+
+// True if f holds exactly the bytes of parts, which add up to size.
+static bool sameContents(FILE* f, const vector<OutputBuffer::Block>& parts, size_t size)
+{
+	if (fseek(f, 0, SEEK_END) != 0 || ftell(f) != static_cast<long>(size) || fseek(f, 0, SEEK_SET) != 0)
+		return false;
+	vector<char> buffer(BlockPool::block_size);
+	for (auto& part: parts) {
+		for (size_t done = 0; done < part.size; ) {
+			size_t n = std::min(part.size - done, buffer.size());
+			if (fread(&buffer[0], 1, n, f) != n || memcmp(&buffer[0], part.data + done, n) != 0)
+				return false;
+			done += n;
+		}
+	}
+	return true;
+}
+
+bool Document::saveIfChanged(bool* written) const
+{
+	if (written) {
+		*written = false;
+	}
+	if (FILE* f = fopen(file_name.c_str(), "rb")) {
+		string head, tail;
+		prologue(head);
+		runToString(tail);
+		epilogue(tail);
+		vector<OutputBuffer::Block> parts;
+		gather(parts, head, tail);
+		size_t size = 0;
+		for (auto& part: parts) {
+			size += part.size;
+		}
+		bool same = sameContents(f, parts, size);
+		fclose(f);
+		if (same) {
+			return true;
+		}
+	}
+	if (written) {
+		*written = true;
+	}
+	return save();
+}
+
+MultiDocument& MultiDocument::add(const string& file_name, const Layout& layout)
+{
+	documents.push_back(Document(file_name, layout));
+	return *this;
+}
+
+MultiDocument& MultiDocument::operator << (const Shape& shape)
+{
+	for (auto& doc: documents) {
+		doc << shape;
+	}
+	return *this;
+}
+
+MultiDocument& MultiDocument::operator << (const Circle& circle)
+{
+	for (auto& doc: documents) {
+		doc << circle;
+	}
+	return *this;
+}
+
+MultiDocument& MultiDocument::operator << (const Elipse& elipse)
+{
+	for (auto& doc: documents) {
+		doc << elipse;
+	}
+	return *this;
+}
+
+MultiDocument& MultiDocument::operator << (const Rectangle& rectangle)
+{
+	for (auto& doc: documents) {
+		doc << rectangle;
+	}
+	return *this;
+}
+
+MultiDocument& MultiDocument::operator << (const ShapeList& shapes)
+{
+	for (auto& entry: shapes.order) {
+		for (auto& doc: documents) {
+			doc.add(shapes, entry);
+		}
+	}
+	return *this;
+}
+
+bool MultiDocument::save() const
+{
+	bool ok = true;
+	for (auto& doc: documents) {
+		ok = doc.save() && ok;
+	}
+	return ok;
+}
+
+} // namespace svg
@@ -32,22 +32,78 @@ SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF SUCH DAMAGE.
 
 #pragma once
 
+// Public interface of the Simple SVG library.  The serialization code lives in
+// simple_svg.cpp and is built as the simple-svg-lib static library, so this
+// header only needs the standard library.
+
 #include <vector>
 #include <string>
 #include <initializer_list>
-#include <boost/optional.hpp>
-#include <boost/lexical_cast.hpp>
-#include <boost/algorithm/string/join.hpp>
+#include <functional>
+#include <iterator>
+#include <memory>
+#include <unordered_map>
+#include <new>
+#include <type_traits>
+#include <mutex>
+#include <cstdint>
 
-using boost::optional;
-using boost::make_optional;
 using std::string;
 using std::vector;
 using std::initializer_list;
 
+// VS2013 (v120) has no noexcept; throw() is its non-throwing spelling.
+#if defined(_MSC_VER) && _MSC_VER < 1900
+#define SVG_NOEXCEPT throw()
+#else
+#define SVG_NOEXCEPT noexcept
+#endif
+
 namespace svg {
 
+// Minimal optional value, used instead of boost::optional to keep this header
+// free of Boost.
+template <typename T>
+class optional
+{
+public:
+	optional() : has_value(false), val() { }
+	optional(const T& v) : has_value(true), val(v) { }
+
+	explicit operator bool() const { return has_value; }
+	T& operator * () { return val; }
+	const T& operator * () const { return val; }
+	T* operator -> () { return &val; }
+	const T* operator -> () const { return &val; }
+
+private:
+	bool has_value;
+	T val;
+};
+
+template <typename T>
+optional<T> make_optional(const T& v)
+{
+	return optional<T>(v);
+}
+
 // Utility XML/String Functions.
+
+// Defined in simple_svg.cpp.  Narrower integer types promote to int; any
+// other type has no overload and fails to compile.
+string toString(bool v);
+string toString(char v);
+string toString(int v);
+string toString(unsigned v);
+string toString(long v);
+string toString(unsigned long v);
+string toString(long long v);
+string toString(unsigned long long v);
+string toString(float v);
+string toString(double v);
+string toString(const string& v);
+string toString(const char* v);
+
 template <typename T>
 void attribute(
 	string& s,
@@ -61,26 +117,9 @@ void attribute(
 	s += unit;
 	s += "\" ";
 }
-void elemStart(string& s, const string& element_name)
-{
-	s += "\t<";
-	s += element_name;
-	s += " ";
-}
-string elemEnd(const string& element_name)
-{
-	return "</" + element_name + ">\n";
-}
-string emptyElemEnd()
-{
-	return "/>\n";
-}
-
-template <typename T>
-string toString(const T& v)
-{
-	return boost::lexical_cast<string>(v);
-}
+void elemStart(string& s, const string& element_name);
+string elemEnd(const string& element_name);
+string emptyElemEnd();
 
 struct Dimensions
 {
@@ -104,36 +143,115 @@ struct Point
 	}
 };
 
-optional<Point> getMinPoint(const vector<Point>& points)
+// Point container with room for a few points inline.  Short shapes (glyphs,
+// markers, small polygons) never touch the heap; longer ones spill into a
+// heap buffer that grows geometrically.
+class PointList
 {
-	if (points.empty())
-		return optional<Point>();
-	Point min = points[0];
-	for (unsigned i = 1; i < points.size(); ++i) {
-		auto& pt = points[i];
-		if (pt.x < min.x) min.x = pt.x;
-		if (pt.y < min.y) min.y = pt.y;
+public:
+	enum { inline_capacity = 16 };
+
+	typedef Point* iterator;
+	typedef const Point* const_iterator;
+
+	PointList() : data_(inlineData()), size_(0), capacity_(inline_capacity) { }
+	PointList(const Point* points, size_t count);
+	PointList(initializer_list<Point> points);
+	PointList(const vector<Point>& points);
+	template <typename InputIt>
+	PointList(InputIt first, InputIt last)
+		:
+		data_(inlineData()),
+		size_(0),
+		capacity_(inline_capacity)
+	{
+		assign(first, last, typename std::iterator_traits<InputIt>::iterator_category());
 	}
-	return make_optional(min);
-}
+	PointList(const PointList& other);
+	// Moves never allocate: a heap buffer changes hands and inline points
+	// fit in the inline storage.  Being noexcept lets vector<Polygon> move
+	// its elements rather than copy them when it grows.
+	PointList(PointList&& other) SVG_NOEXCEPT;
+	~PointList();
 
-optional<Point> getMaxPoint(const vector<Point>& points)
-{
-	if (points.empty())
-		return optional<Point>();
-	Point max = points[0];
-	for (unsigned i = 1; i < points.size(); ++i) {
-		auto& pt = points[i];
-		if (pt.x > max.x) max.x = pt.x;
-		if (pt.y > max.y) max.y = pt.y;
+	PointList& operator = (const PointList& other);
+	PointList& operator = (PointList&& other) SVG_NOEXCEPT;
+
+	void push_back(const Point& point)
+	{
+		if (size_ == capacity_)
+			grow(size_ + 1);
+		new (data_ + size_) Point(point);
+		++size_;
 	}
-	return make_optional(max);
-}
+	void append(const Point* points, size_t count);
+	void reserve(size_t count)
+	{
+		if (count > capacity_)
+			grow(count);
+	}
+	void clear() { size_ = 0; }
+
+	size_t size() const { return size_; }
+	size_t capacity() const { return capacity_; }
+	bool empty() const { return size_ == 0; }
+	bool isInline() const { return data_ == inlineData(); }
 
-// Defines the dimensions, scale, origin, and origin offset of the document.
+	Point* data() { return data_; }
+	const Point* data() const { return data_; }
+	Point& operator [] (size_t i) { return data_[i]; }
+	const Point& operator [] (size_t i) const { return data_[i]; }
+	Point& back() { return data_[size_ - 1]; }
+	const Point& back() const { return data_[size_ - 1]; }
+
+	iterator begin() { return data_; }
+	iterator end() { return data_ + size_; }
+	const_iterator begin() const { return data_; }
+	const_iterator end() const { return data_ + size_; }
+
+private:
+	template <typename InputIt>
+	void assign(InputIt first, InputIt last, std::input_iterator_tag)
+	{
+		for (; first != last; ++first)
+			push_back(*first);
+	}
+	template <typename ForwardIt>
+	void assign(ForwardIt first, ForwardIt last, std::forward_iterator_tag)
+	{
+		reserve(static_cast<size_t>(std::distance(first, last)));
+		for (; first != last; ++first)
+			push_back(*first);
+	}
+
+	Point* inlineData() { return reinterpret_cast<Point*>(&inline_storage); }
+	const Point* inlineData() const { return reinterpret_cast<const Point*>(&inline_storage); }
+	void grow(size_t min_capacity);
+	void release();
+
+	Point* data_;
+	size_t size_;
+	size_t capacity_;
+	std::aligned_storage<
+		sizeof(Point) * inline_capacity,
+		std::alignment_of<Point>::value
+	>::type inline_storage;
+};
+
+optional<Point> getMinPoint(const vector<Point>& points);
+optional<Point> getMaxPoint(const vector<Point>& points);
+optional<Point> getMinPoint(const PointList& points);
+optional<Point> getMaxPoint(const PointList& points);
+
+// Defines the dimensions, scale, origin, and origin offset of the document,
+// and whether it is written readably or as compactly as possible.
 struct Layout
 {
 	enum Origin { TopLeft, BottomLeft, TopRight, BottomRight };
+	// Minified output drops indentation, newlines and the DOCTYPE preamble,
+	// writes the shortest form of numbers and colours, and leaves out
+	// attributes that equal the SVG defaults.
+	enum Format { Pretty, Minified };
 
 	Layout(const Dimensions& dimensions = Dimensions(400, 300),
 		Origin origin = BottomLeft,
@@ -143,12 +261,16 @@ struct Layout
 		dimensions(dimensions),
 		scale(scale),
 		origin(origin),
-		origin_offset(origin_offset)
+		origin_offset(origin_offset),
+		format(Pretty)
 	{ }
 	Dimensions dimensions;
 	double scale;
 	Origin origin;
 	Point origin_offset;
+	Format format;
+
+	bool minified() const { return format == Minified; }
 };
 
 template <typename T>
@@ -164,27 +286,33 @@ void attribute(
 	s += "\" ";
 }
 
-// Convert coordinates in user space to SVG native space.
-double translateX(double x, const Layout& layout)
-{
-	if (layout.origin == Layout::BottomRight || layout.origin == Layout::TopRight)
-		return layout.dimensions.width - ((x + layout.origin_offset.x) * layout.scale);
-	else
-		return (layout.origin_offset.x + x) * layout.scale;
-}
+// Layout-aware variants of the helpers above, honouring Layout::format.
+void elemStart(string& s, const string& element_name, const Layout& layout);
+// Closes a start tag that is followed by content.
+void startTagEnd(string& s, const Layout& layout);
+void elemEnd(string& s, const string& element_name, const Layout& layout);
+void emptyElemEnd(string& s, const Layout& layout);
+void numberToString(string& s, double value, const Layout& layout);
+void attribute(
+	string& s,
+	const string& attribute_name,
+	double value,
+	const Layout& layout);
+// Like attribute(), but left out of minified output when value is 0, the SVG
+// default for x, y, cx, cy, x1 and so on.
+void coordinateAttribute(
+	string& s,
+	const string& attribute_name,
+	double value,
+	const Layout& layout);
 
-double translateY(double y, const Layout& layout)
-{
-	if (layout.origin == Layout::BottomLeft || layout.origin == Layout::BottomRight)
-		return layout.dimensions.height - ((y + layout.origin_offset.y) * layout.scale);
-	else
-		return (layout.origin_offset.y + y) * layout.scale;
-}
+// Convert coordinates in user space to SVG native space.
+double translateX(double x, const Layout& layout);
+double translateY(double y, const Layout& layout);
+double translateScale(double dimension, const Layout& layout);
 
-double translateScale(double dimension, const Layout& layout)
-{
-	return dimension * layout.scale;
-}
+struct Document;
+class MappedScene;
 
 struct Serializeable
 {
@@ -199,47 +327,9 @@ struct Color : public Serializeable
 		Green, Lime, Magenta, Orange, Purple, Red, Silver, White, Yellow };
 
 	Color(int r, int g, int b) : transparent(false), red(r), green(g), blue(b) { }
-	Color(Defaults color)
-		:
-		transparent(false),
-		red(0),
-		green(0),
-		blue(0)
-	{
-		switch (color) {
-		case Aqua: assign(0, 255, 255); break;
-		case Black: assign(0, 0, 0); break;
-		case Blue: assign(0, 0, 255); break;
-		case Brown: assign(165, 42, 42); break;
-		case Cyan: assign(0, 255, 255); break;
-		case Fuchsia: assign(255, 0, 255); break;
-		case Green: assign(0, 128, 0); break;
-		case Lime: assign(0, 255, 0); break;
-		case Magenta: assign(255, 0, 255); break;
-		case Orange: assign(255, 165, 0); break;
-		case Purple: assign(128, 0, 128); break;
-		case Red: assign(255, 0, 0); break;
-		case Silver: assign(192, 192, 192); break;
-		case White: assign(255, 255, 255); break;
-		case Yellow: assign(255, 255, 0); break;
-		default: transparent = true; break;
-		}
-	}
+	Color(Defaults color);
 	virtual ~Color() { }
-	void toString(string& s, const Layout&) const override
-	{
-		if (transparent)
-			s += "transparent";
-		else {
-			s += "rgb(";
-			s += svg::toString(red);
-			s += ",";
-			s += svg::toString(green);
-			s += ",";
-			s += svg::toString(blue);
-			s += ")";
-		}
-	}
+	void toString(string& s, const Layout&) const override;
 
 	bool transparent;
 	int red;
@@ -258,10 +348,7 @@ struct Fill : public Serializeable
 {
 	Fill(Color::Defaults color) : color(color) { }
 	Fill(Color color = Color::Transparent) : color(color) { }
-	void toString(string& s, const Layout& layout) const override
-	{
-		attribute(s, "fill", color, layout);
-	}
+	void toString(string& s, const Layout& layout) const override;
 	Color color;
 };
 
@@ -279,33 +366,11 @@ struct Stroke : public Serializeable
 		color(color)
 	{ }
 
-	static const char* toString(Linecap linecap) {
-		switch (linecap) {
-		case Linecap::butt: return "butt";
-		case Linecap::round: return "round";
-		case Linecap::square: return "square";
-		default: return "butt";
-		}
-	}
-	void toString(string& s, const Layout& layout) const override
-	{
-		// If stroke width is invalid.
-		if (width < 0)
-			return;
-		attribute(s, "stroke", color, layout);
-		attribute(s, "stroke-width", translateScale(width, layout));
-		if (linecap) {
-			attribute(s, "stroke-linecap", toString(*linecap));
-		}
-		if (!dasharray.empty()) {
-			string tmp;
-			for (auto dash: dasharray) {
-				tmp += svg::toString(dash);
-				tmp += ",";
-			}
-			attribute(s, "stroke-dasharray", tmp);
-		}
-	}
+	static const char* toString(Linecap linecap);
+	void toString(string& s, const Layout& layout) const override;
+	// The pieces of toString() after the stroke colour.
+	void widthToString(string& s, const Layout& layout) const;
+	void tailToString(string& s, const Layout& layout) const;
 
 	double width;
 	Color color;
@@ -316,37 +381,92 @@ struct Stroke : public Serializeable
 struct Font : public Serializeable
 {
 	Font(double size = 12, const string& family = "Verdana") : size(size), family(family) { }
-	void toString(string& s, const Layout& layout) const override
-	{
-		attribute(s, "font-size", translateScale(size, layout));
-		attribute(s, "font-family", family);
-	}
+	void toString(string& s, const Layout& layout) const override;
 	double size;
 	string family;
 };
 
+// Immutable fill, stroke and font combination.  Shapes refer to a Style
+// through a shared StyleRef, so a scene with millions of shapes and a handful
+// of looks stores each look once.
+class Style
+{
+public:
+	Style(const Fill& fill = Fill(), const Stroke& stroke = Stroke(), const Font& font = Font());
+
+	// Renders the attributes that do not depend on the Layout once, so later
+	// serialization only formats the scaled stroke width and font size.
+	// StylePool calls this for every style it hands out.
+	void prerender();
+
+	void toString(string& s, const Layout& layout) const;
+	void fillToString(string& s, const Layout& layout) const;
+	void strokeToString(string& s, const Layout& layout) const;
+	void fontToString(string& s, const Layout& layout) const;
+
+	const Fill& fill() const { return fill_; }
+	const Stroke& stroke() const { return stroke_; }
+	const Font& font() const { return font_; }
+
+	size_t hash() const;
+	bool operator == (const Style& other) const;
+
+private:
+	Fill fill_;
+	Stroke stroke_;
+	Font font_;
+
+	// Pre-rendered attributes, one set per Layout::Format.  Allocated by
+	// prerender() only, so the many styles that are never pooled stay small.
+	struct Segments
+	{
+		string fill;
+		string stroke_color;
+		string stroke_tail;
+		string font_family;
+	};
+	struct Prerendered
+	{
+		Segments formats[2];
+	};
+	std::shared_ptr<const Prerendered> prerendered;
+};
+
+typedef std::shared_ptr<const Style> StyleRef;
+
+// Interns styles by value: equal fill/stroke/font combinations come back as
+// the same StyleRef.
+class StylePool
+{
+public:
+	StyleRef get(const Fill& fill, const Stroke& stroke = Stroke(), const Font& font = Font());
+	StyleRef get(const Style& style);
+	size_t size() const { return styles.size(); }
+
+private:
+	std::unordered_multimap<size_t, StyleRef> styles;
+};
+
 struct Shape : public Serializeable
 {
 	Shape(const Fill& fill = Fill(), const Stroke& stroke = Stroke())
 		:
-		fill(fill),
-		stroke(stroke)
+		style(std::make_shared<Style>(fill, stroke))
 	{ }
+	Shape(const StyleRef& style) : style(style) { }
 	virtual ~Shape() { }
 	virtual void toString(string& s, const Layout& layout) const = 0;
 	virtual void offset(const Point& offset) = 0;
+	// Appends to doc.pending under doc.layout.  Shapes whose output can be
+	// large override this to call doc.commit() as they go, so it moves into
+	// the document's blocks piece by piece instead of growing one string.
+	virtual void serialize(Document& doc) const;
 
-	Fill fill;
-	Stroke stroke;
-};
+	const Fill& fill() const { return style->fill(); }
+	const Stroke& stroke() const { return style->stroke(); }
 
-template <typename T>
-void vectorToString(string& s, const vector<T>& collection, const Layout& layout)
-{
-	for (auto& val: collection) {
-		val.toString(s, layout);
-	}
-}
+	StyleRef style;
+};
 
 struct Circle : public Shape
 {
@@ -359,20 +479,17 @@ struct Circle : public Shape
 		center(center),
 		radius(diameter / 2)
 	{ }
-	void toString(string& s, const Layout& layout) const override
-	{
-		elemStart(s, "circle");
-		attribute(s, "cx", translateX(center.x, layout));
-		attribute(s, "cy", translateY(center.y, layout));
-		attribute(s, "r", translateScale(radius, layout));
-		fill.toString(s, layout);
-		stroke.toString(s, layout);
-		s += emptyElemEnd();
-	}
-	void offset(const Point& offset)
-	{
-		center += offset;
-	}
+	Circle(const Point& center, double diameter, const StyleRef& style)
+		:
+		Shape(style),
+		center(center),
+		radius(diameter / 2)
+	{ }
+	void toString(string& s, const Layout& layout) const override;
+	// Writes a circle without needing a Circle object.
+	static void toString(string& s, const Layout& layout,
+		const Point& center, double radius, const Style& style);
+	void offset(const Point& offset) override;
 	Point center;
 	double radius;
 };
@@ -390,21 +507,17 @@ struct Elipse : public Shape
 		radius_width(width / 2),
 		radius_height(height / 2)
 	{ }
-	void toString(string& s, const Layout& layout) const override
-	{
-		elemStart(s, "ellipse");
-		attribute(s, "cx", translateX(center.x, layout));
-		attribute(s, "cy", translateY(center.y, layout));
-		attribute(s, "rx", translateScale(radius_width, layout));
-		attribute(s, "ry", translateScale(radius_height, layout));
-		fill.toString(s, layout);
-		stroke.toString(s, layout);
-		s += emptyElemEnd();
-	}
-	void offset(const Point& offset)
-	{
-		center += offset;
-	}
+	Elipse(const Point& center, double width, double height, const StyleRef& style)
+		:
+		Shape(style),
+		center(center),
+		radius_width(width / 2),
+		radius_height(height / 2)
+	{ }
+	void toString(string& s, const Layout& layout) const override;
+	static void toString(string& s, const Layout& layout,
+		const Point& center, double radius_width, double radius_height, const Style& style);
+	void offset(const Point& offset) override;
 	Point center;
 	double radius_width;
 	double radius_height;
@@ -423,21 +536,17 @@ struct Rectangle : public Shape
 		width(width),
 		height(height)
 	{ }
-	void toString(string& s, const Layout& layout) const override
-	{
-		elemStart(s, "rect");
-		attribute(s, "x", translateX(edge.x, layout));
-		attribute(s, "y", translateY(edge.y, layout));
-		attribute(s, "width", translateScale(width, layout));
-		attribute(s, "height", translateScale(height, layout));
-		fill.toString(s, layout);
-		stroke.toString(s, layout);
-		s += emptyElemEnd();
-	}
-	void offset(const Point& offset)
-	{
-		edge += offset;
-	}
+	Rectangle(const Point& edge, double width, double height, const StyleRef& style)
+		:
+		Shape(style),
+		edge(edge),
+		width(width),
+		height(height)
+	{ }
+	void toString(string& s, const Layout& layout) const override;
+	static void toString(string& s, const Layout& layout,
+		const Point& edge, double width, double height, const Style& style);
+	void offset(const Point& offset) override;
 
 	Point edge;
 	double width;
@@ -454,21 +563,16 @@ struct Line : public Shape
 		start_point(start_point),
 		end_point(end_point)
 	{ }
-	void toString(string& s, const Layout& layout) const override
-	{
-		elemStart(s, "line");
-		attribute(s, "x1", translateX(start_point.x, layout));
-		attribute(s, "y1", translateY(start_point.y, layout));
-		attribute(s, "x2", translateX(end_point.x, layout));
-		attribute(s, "y2", translateY(end_point.y, layout));
-		stroke.toString(s, layout);
-		s += emptyElemEnd();
-	}
-	void offset(const Point& offset)
-	{
-		start_point += offset;
-		end_point += offset;
-	}
+	Line(const Point& start_point, const Point& end_point, const StyleRef& style)
+		:
+		Shape(style),
+		start_point(start_point),
+		end_point(end_point)
+	{ }
+	void toString(string& s, const Layout& layout) const override;
+	static void toString(string& s, const Layout& layout,
+		const Point& start_point, const Point& end_point, const Style& style);
+	void offset(const Point& offset) override;
 
 	Point start_point;
 	Point end_point;
@@ -481,34 +585,25 @@ struct Polygon : public Shape
 		Shape(fill, stroke)
 	{ }
 	Polygon(const Stroke& stroke = Stroke()) : Shape(Color::Transparent, stroke) { }
+	Polygon(const StyleRef& style) : Shape(style) { }
+	Polygon(const PointList& points,
+		const Fill& fill = Fill(),
+		const Stroke& stroke = Stroke())
+		:
+		Shape(fill, stroke),
+		points(points)
+	{ }
 	Polygon& operator << (const Point& point)
 	{
 		points.push_back(point);
 		return *this;
 	}
-	void toString(string& s, const Layout& layout) const override
-	{
-		elemStart(s, "polygon");
-		s += "points=\"";
-		for (auto& pt: points) {
-			s += svg::toString(translateX(pt.x, layout));
-			s += ",";
-			s += svg::toString(translateY(pt.y, layout));
-			s += " ";
-		}
-		s += "\" ";
-		fill.toString(s, layout);
-		stroke.toString(s, layout);
-		s += emptyElemEnd();
-	}
-	void offset(const Point& offset)
-	{
-		for (auto& pt: points) {
-			pt += offset;
-		}
-	}
+	void toString(string& s, const Layout& layout) const override;
+	static void toString(string& s, const Layout& layout,
+		const Point* points, size_t count, const Style& style);
+	void offset(const Point& offset) override;
 
-	vector<Point> points;
+	PointList points;
 };
 
 struct Polyline : public Shape
@@ -516,7 +611,8 @@ struct Polyline : public Shape
 	Polyline(const Fill& fill = Fill(), const Stroke& stroke = Stroke())
 		: Shape(fill, stroke) { }
 	Polyline(const Stroke& stroke = Stroke()) : Shape(Color::Transparent, stroke) { }
-	Polyline(const vector<Point>& points,
+	Polyline(const StyleRef& style) : Shape(style) { }
+	Polyline(const PointList& points,
 		const Fill& fill = Fill(),
 		const Stroke& stroke = Stroke())
 		:
@@ -526,6 +622,7 @@ struct Polyline : public Shape
 
 	Polyline& operator += (initializer_list<double[2]> pts)
 	{
+		points.reserve(points.size() + pts.size());
 		for (auto& pt: pts) {
 			points.push_back(Point(pt[0], pt[1]));
 		}
@@ -538,28 +635,11 @@ struct Polyline : public Shape
 		return *this;
 	}
 
-	void toString(string& s, const Layout& layout) const override
-	{
-		elemStart(s, "polyline");
-		s += "points=\"";
-		for (auto& pt: points) {
-			s += svg::toString(translateX(pt.x, layout));
-			s += ",";
-			s += svg::toString(translateY(pt.y, layout));
-			s += " ";
-		}
-		s += "\" ";
-		fill.toString(s, layout);
-		stroke.toString(s, layout);
-		s += emptyElemEnd();
-	}
-	void offset(const Point& offset)
-	{
-		for (auto& pt: points) {
-			pt += offset;
-		}
-	}
-	vector<Point> points;
+	void toString(string& s, const Layout& layout) const override;
+	static void toString(string& s, const Layout& layout,
+		const Point* points, size_t count, const Style& style);
+	void offset(const Point& offset) override;
+	PointList points;
 };
 
 struct Text : public Shape
@@ -571,31 +651,163 @@ struct Text : public Shape
 		const Stroke& stroke = Stroke()
 		)
 		:
-		Shape(fill, stroke),
+		Shape(std::make_shared<Style>(fill, stroke, font)),
 		origin(origin),
-		content(content),
-		font(font)
+		content(content)
 	{ }
-	void toString(string& s, const Layout& layout) const override
+	Text(const Point& origin, const string& content, const StyleRef& style)
+		:
+		Shape(style),
+		origin(origin),
+		content(content)
+	{ }
+	void toString(string& s, const Layout& layout) const override;
+	static void toString(string& s, const Layout& layout,
+		const Point& origin, const char* content, size_t length, const Style& style);
+	void offset(const Point& offset) override;
+
+	const Font& font() const { return style->font(); }
+
+	Point origin;
+	string content;
+};
+
+// A contiguous run of points owned by someone else.
+struct PointSpan
+{
+	PointSpan(const Point* data = nullptr, size_t size = 0) : data(data), size(size) { }
+	const Point* data;
+	size_t size;
+};
+
+// Sliding window over the last capacity() samples of a metric.  push() is
+// O(1): once the window is full it overwrites the oldest sample.  The bounds
+// of the window are tracked with monotonic queues, so getMinPoint() and
+// getMaxPoint() stay current as samples are evicted without rescanning.
+class TimeSeries
+{
+public:
+	TimeSeries(size_t capacity, const Stroke& stroke = Stroke());
+	TimeSeries(size_t capacity, const StyleRef& style);
+
+	void push(const Point& point);
+	TimeSeries& operator << (const Point& point)
 	{
-		elemStart(s, "text");
-		attribute(s, "x", translateX(origin.x, layout));
-		attribute(s, "y", translateY(origin.y, layout));
-		fill.toString(s, layout);
-		stroke.toString(s, layout);
-		font.toString(s, layout);
-		s += ">";
-		s += content;
-		s += elemEnd("text");
+		push(point);
+		return *this;
 	}
-	void offset(const Point& offset)
+	void clear();
+
+	size_t size() const { return count; }
+	size_t capacity() const { return buffer.size(); }
+	bool empty() const { return count == 0; }
+	// Index 0 is the oldest sample in the window.
+	const Point& operator [] (size_t i) const { return buffer[(head + i) % buffer.size()]; }
+
+	optional<Point> getMinPoint() const;
+	optional<Point> getMaxPoint() const;
+
+	// The window as two contiguous runs, oldest first.  The second run is
+	// empty until the buffer wraps around.
+	PointSpan first() const;
+	PointSpan second() const;
+
+	StyleRef style;
+
+private:
+	// Ring of sample sequence numbers whose coordinates are monotonic, so the
+	// front is always the extremum of the window.
+	struct Extremum
 	{
-		origin += offset;
+		vector<unsigned long long> seqs;
+		size_t head;
+		size_t size;
+	};
+	void track(Extremum& e, unsigned long long seq, bool use_y, bool is_max);
+	void evict(Extremum& e, unsigned long long seq);
+	const Point& sample(unsigned long long seq) const { return buffer[seq % buffer.size()]; }
+
+	vector<Point> buffer;
+	size_t head;
+	size_t count;
+	unsigned long long next_seq;
+	Extremum min_x;
+	Extremum min_y;
+	Extremum max_x;
+	Extremum max_y;
+};
+
+// Lazily produced points.  A PointSource hands out one point per call and
+// returns false once it is exhausted; a PointSourceFactory starts a new pass
+// over the same data, so a shape can read it more than once without storing
+// it.
+typedef std::function<bool (Point&)> PointSource;
+typedef std::function<PointSource ()> PointSourceFactory;
+
+// Pass over [first, last) that reads the range on demand.  The range must
+// stay valid while the shape using it is serialized.  Shapes may read it
+// several times (bounds, line, markers), so single-pass iterators such as
+// stream or cursor iterators are rejected; wrap those in a factory that
+// reopens the source instead.
+template <typename ForwardIt>
+PointSourceFactory pointRange(ForwardIt first, ForwardIt last)
+{
+	static_assert(std::is_base_of<std::forward_iterator_tag,
+		typename std::iterator_traits<ForwardIt>::iterator_category>::value,
+		"pointRange needs a multi-pass (forward) iterator");
+	return [=]() -> PointSource {
+		ForwardIt it = first;
+		return [=](Point& pt) mutable -> bool {
+			if (it == last)
+				return false;
+			pt = *it;
+			++it;
+			return true;
+		};
+	};
+}
+
+// count samples of f evenly spaced over [x0, x1].
+PointSourceFactory sampleFunction(const std::function<double (double)>& f,
+	double x0, double x1, size_t count);
+
+// Polyline whose points are pulled from a PointSourceFactory while it is
+// serialized, so the points are never held in memory.  Without bounds from
+// setBounds() they are computed by an extra streaming pass when needed.
+struct GeneratedPolyline : public Shape
+{
+	GeneratedPolyline(const PointSourceFactory& source,
+		const Stroke& stroke = Stroke())
+		:
+		Shape(Color::Transparent, stroke),
+		source(source)
+	{ }
+	GeneratedPolyline(const PointSourceFactory& source, const StyleRef& style)
+		:
+		Shape(style),
+		source(source)
+	{ }
+
+	void setBounds(const Point& min, const Point& max)
+	{
+		min_point = min;
+		max_point = max;
 	}
+	// Returns false if the source yields no points.
+	bool getBounds(Point& min, Point& max) const;
 
-	Point origin;
-	string content;
-	Font font;
+	void toString(string& s, const Layout& layout) const override;
+	void serialize(Document& doc) const override;
+	void offset(const Point& offset) override;
+
+	PointSourceFactory source;
+	Point shift;
+	optional<Point> min_point;
+	optional<Point> max_point;
+
+private:
+	// Commits to doc, if given, after every point.
+	void write(string& s, const Layout& layout, Document* doc) const;
 };
 
 // Sample charting class.
@@ -609,134 +821,380 @@ struct LineChart : public Shape
 		margin(margin),
 		scale(scale)
 	{ }
-	LineChart& operator << (const Polyline& polyline)
-	{
-		if (polyline.points.empty())
-			return *this;
-		polylines.push_back(polyline);
-		return *this;
-	}
-	void toString(string& s, const Layout& layout) const override
-	{
-		if (polylines.empty())
-			return;
-		for (auto& polyline: polylines) {
-			polylineToString(s, polyline, layout);
-		}
-		axisString(s, layout);
-	}
-	void offset(const Point& offset)
-	{
-		for (auto& polyline: polylines) {
-			polyline.offset(offset);
-		}
-	}
+	LineChart& operator << (const Polyline& polyline);
+	// Draws the live window of a series that the caller keeps updating.  The
+	// chart only keeps a pointer, so the series must outlive it and is not
+	// moved by offset().
+	LineChart& operator << (const TimeSeries& series);
+	LineChart& operator << (const GeneratedPolyline& polyline);
+	void toString(string& s, const Layout& layout) const override;
+	void serialize(Document& doc) const override;
+	void offset(const Point& offset) override;
 
 	Stroke axis_stroke;
 	Dimensions margin;
 	double scale;
 	vector<Polyline> polylines;
+	vector<const TimeSeries*> series;
+	vector<GeneratedPolyline> generated;
+
+	optional<Dimensions> getDimensions() const;
+	void axisString(string& s, const Layout& layout) const;
+	void polylineToString(string& s, const Polyline& polyline, const Layout& layout) const;
+
+private:
+	void axisString(string& s, const Dimensions& dimensions, const Layout& layout) const;
+	// Commits to doc, if given, after every point and marker.
+	void write(string& s, const Layout& layout, Document* doc) const;
+};
 
-	optional<Dimensions> getDimensions() const
+// Maps a value in [0, 1] to a colour by linear interpolation between evenly
+// spaced stops.  The result is quantized to a fixed number of levels so that
+// neighbouring cells of similar density get exactly the same colour.
+struct ColorMap
+{
+	ColorMap(unsigned levels = 32);
+	ColorMap(initializer_list<Color> stops, unsigned levels = 32);
+	Color operator () (double t) const;
+	unsigned level(double t) const;
+	Color levelColor(unsigned level) const;
+
+	vector<Color> stops;
+	unsigned levels;
+};
+
+// Density plot for data sets far larger than the output resolution.  Points
+// are binned into a grid of cell_size x cell_size device pixels and every
+// row is written as one rectangle per run of cells with the same colour, so
+// the size of the output depends on the document dimensions, not on the
+// number of points.  Binning is split across threads for large inputs.
+struct Heatmap : public Shape
+{
+	Heatmap(double cell_size = 1,
+		const ColorMap& color_map = ColorMap(),
+		unsigned threads = 0)
+		:
+		cell_size(cell_size),
+		color_map(color_map),
+		threads(threads)
+	{ }
+	Heatmap& operator << (const Point& point)
 	{
-		if (polylines.empty())
-			return optional<Dimensions>();
-
-		auto min = getMinPoint(polylines[0].points);
-		auto max = getMaxPoint(polylines[0].points);
-		for (unsigned i = 1; i < polylines.size(); ++i) {
-			auto minPt = getMinPoint(polylines[i].points);
-			auto maxPt = getMaxPoint(polylines[i].points);
-			if (minPt->x < min->x)	min->x = minPt->x;
-			if (minPt->y < min->y)	min->y = minPt->y;
-			if (maxPt->x > max->x)	max->x = maxPt->x;
-			if (maxPt->y > max->y)	max->y = maxPt->y;
-		}
+		points.push_back(point);
+		return *this;
+	}
+	void append(const Point* points, size_t count);
+	void toString(string& s, const Layout& layout) const override;
+	void serialize(Document& doc) const override;
+	void offset(const Point& offset) override;
+
+	// Number of points per cell, row by row.
+	vector<unsigned> bin(const Layout& layout, unsigned& columns, unsigned& rows) const;
+
+	double cell_size;
+	ColorMap color_map;
+	// 0 uses std::thread::hardware_concurrency().
+	unsigned threads;
+	vector<Point> points;
 
-		return make_optional(Dimensions(max->x - min->x, max->y - min->y));
+private:
+	// Commits to doc, if given, after every row.
+	void write(string& s, const Layout& layout, Document* doc) const;
+};
+
+// Estimated advance width of content set in font, in the same units as
+// Font::size.  Uses built-in per-family tables of ASCII advances (Verdana,
+// Helvetica/Arial, Times and monospace); unknown families are measured as
+// Verdana and other characters at the family's digit width.
+double textWidth(const string& content, const Font& font);
+
+// Text labels that are thinned out at serialization time: each label's
+// bounding box is estimated with textWidth() in device space, and labels are
+// placed in order of decreasing priority, dropping any that would overlap
+// one already placed.  Placed labels are kept in a spatial hash, so culling
+// stays close to linear in the number of labels.  Survivors are written in
+// the order they were added.
+struct LabelLayer : public Shape
+{
+	// padding: minimum gap, in device pixels, between two placed labels.
+	explicit LabelLayer(double padding = 0) : padding(padding) { }
+
+	LabelLayer& add(const Text& label, double priority = 0)
+	{
+		labels.push_back(label);
+		priorities.push_back(priority);
+		return *this;
 	}
-	void axisString(string& s, const Layout& layout) const
+	LabelLayer& operator << (const Text& label) { return add(label); }
+
+	// Indices of the labels that survive culling under layout, ascending.
+	vector<size_t> visible(const Layout& layout) const;
+	void toString(string& s, const Layout& layout) const override;
+	void serialize(Document& doc) const override;
+	void offset(const Point& offset) override;
+
+	double padding;
+	vector<Text> labels;
+	vector<double> priorities;
+
+private:
+	// Commits to doc, if given, after every label.
+	void write(string& s, const Layout& layout, Document* doc) const;
+};
+
+// Stores the primitive shapes by value, one contiguous array per type, plus
+// the order they were added in.  Serialization switches on the type tag and
+// calls the concrete toString directly instead of going through Shape's
+// vtable; when the drawing order doesn't matter toStringByType walks each
+// array in turn.
+class ShapeList
+{
+public:
+	enum Type { CircleType, ElipseType, RectangleType, LineType, PolygonType, PolylineType, TextType };
+
+	struct Entry
 	{
-		optional<Dimensions> dimensions = getDimensions();
-		if (!dimensions)
-			return;
+		Entry(Type type, unsigned index) : type(type), index(index) { }
+		Type type;
+		unsigned index;
+	};
 
-		// Make the axis 10% wider and higher than the data points.
-		double width = dimensions->width * 1.1;
-		double height = dimensions->height * 1.1;
+	ShapeList& operator << (const Circle& circle) { return add(circles, CircleType, circle); }
+	ShapeList& operator << (const Elipse& elipse) { return add(elipses, ElipseType, elipse); }
+	ShapeList& operator << (const Rectangle& rectangle) { return add(rectangles, RectangleType, rectangle); }
+	ShapeList& operator << (const Line& line) { return add(lines, LineType, line); }
+	ShapeList& operator << (const Polygon& polygon) { return add(polygons, PolygonType, polygon); }
+	ShapeList& operator << (const Polyline& polyline) { return add(polylines, PolylineType, polyline); }
+	ShapeList& operator << (const Text& text) { return add(texts, TextType, text); }
 
-		// Draw the axis.
-		Polyline axis(Color::Transparent, axis_stroke);
-		axis << Point(margin.width, margin.height + height)
-			<< Point(margin.width, margin.height)
-			<< Point(margin.width + width, margin.height);
+	size_t size() const { return order.size(); }
+	bool empty() const { return order.empty(); }
+	void clear();
 
-		axis.toString(s, layout);
-	}
-	void polylineToString(string& s, const Polyline& polyline, const Layout& layout) const
+	// Serializes the shapes in insertion order.
+	void toString(string& s, const Layout& layout) const;
+	// Serializes a single shape.
+	void toString(const Entry& entry, string& s, const Layout& layout) const;
+	// Serializes all circles, then all ellipses, and so on.
+	void toStringByType(string& s, const Layout& layout) const;
+	// Hash of the geometry, styles and text of every shape, in order, and of
+	// doc's layout and merge_shapes.  Equal hashes mean the shapes add equal
+	// output to doc, so a caller can compare it against a RenderCache entry
+	// before serializing anything.  Whatever else doc holds is not covered.
+	uint64_t hash(const Document& doc) const;
+	void offset(const Point& offset);
+
+	vector<Entry> order;
+	vector<Circle> circles;
+	vector<Elipse> elipses;
+	vector<Rectangle> rectangles;
+	vector<Line> lines;
+	vector<Polygon> polygons;
+	vector<Polyline> polylines;
+	vector<Text> texts;
+
+private:
+	template <typename T>
+	ShapeList& add(vector<T>& shapes, Type type, const T& shape)
 	{
-		Polyline shifted_polyline = polyline;
-		shifted_polyline.offset(Point(margin.width, margin.height));
-
-		vector<Circle> vertices;
-		for (auto& pt: shifted_polyline.points) {
-			vertices.push_back(
-				Circle(
-					pt,
-					getDimensions()->height / 30.0,
-					Color::Black
-				)
-			);
-		}
-		shifted_polyline.toString(s, layout);
-		vectorToString(s, vertices, layout);
+		order.push_back(Entry(type, static_cast<unsigned>(shapes.size())));
+		shapes.push_back(shape);
+		return *this;
 	}
 };
 
+// Recycles the fixed-size blocks OutputBuffer stores its text in, so that
+// rendering many documents in a row doesn't go back to the heap for each one.
+class BlockPool
+{
+public:
+	enum { block_size = 64 * 1024 };
+
+	// Keeps at most max_free idle blocks; the rest are freed on release.
+	explicit BlockPool(size_t max_free = 256) : max_free(max_free) { }
+	~BlockPool();
+
+	char* acquire();
+	void release(char* block);
+
+	// Pool used by buffers that aren't given one.
+	static BlockPool& shared();
+
+private:
+	BlockPool(const BlockPool&);
+	BlockPool& operator = (const BlockPool&);
+
+	std::mutex mutex;
+	vector<char*> free_blocks;
+	size_t max_free;
+};
+
+// Append-only text held in a chain of BlockPool blocks.  Growing it never moves
+// what's already written, and the blocks can be handed to writev as they are.
+class OutputBuffer
+{
+public:
+	struct Block
+	{
+		Block(char* data, size_t size) : data(data), size(size) { }
+		char* data;
+		size_t size;
+	};
+
+	explicit OutputBuffer(BlockPool& pool = BlockPool::shared()) : pool(&pool), total(0) { }
+	OutputBuffer(const OutputBuffer& other);
+	OutputBuffer(OutputBuffer&& other);
+	OutputBuffer& operator = (OutputBuffer other);
+	~OutputBuffer() { clear(); }
+
+	void append(const char* data, size_t size);
+	void append(const string& s) { append(s.data(), s.size()); }
+
+	size_t size() const { return total; }
+	bool empty() const { return total == 0; }
+	const vector<Block>& blocks() const { return chain; }
+	// Returns every block to the pool.
+	void clear();
+	// Appends the whole buffer to s as one contiguous string.
+	void toString(string& s) const;
+
+	friend void swap(OutputBuffer& a, OutputBuffer& b);
+
+private:
+	BlockPool* pool;
+	vector<Block> chain;
+	size_t total;
+};
+
 struct Document
 {
-	Document(const string& file_name, Layout layout = Layout())
+	Document(const string& file_name, Layout layout = Layout(), BlockPool& pool = BlockPool::shared())
 		:
 		file_name(file_name),
-		layout(layout)
+		layout(layout),
+		body(pool),
+		merge_shapes(false),
+		digest(hash_seed),
+		run_length(0),
+		run_style(nullptr)
 	{ }
 
 	Document& operator << (const Shape& shape)
 	{
-		shape.toString(body_nodes_str, layout);
+		endRun();
+		shape.serialize(*this);
 		return *this;
 	}
-	void toString(string& s) const
+	Document& operator << (const Circle& circle);
+	Document& operator << (const Elipse& elipse);
+	Document& operator << (const Rectangle& rectangle);
+	Document& operator << (const ShapeList& shapes);
+	// Defined in scene_cache.cpp.
+	Document& operator << (const MappedScene& scene);
+	// Adds a single shape of a ShapeList.
+	Document& add(const ShapeList& shapes, const ShapeList::Entry& entry);
+	// Moves pending into body once it's grown to a block.  Call after
+	// serializing into pending directly.
+	void commit()
 	{
-		s += "<?xml ";
-		attribute(s, "version", "1.0");
-		attribute(s, "standalone", "no");
-		s += "?>\n<!DOCTYPE svg PUBLIC \"-//W3C//DTD SVG 1.1//EN\" ";
-		s += "\"http://www.w3.org/Graphics/SVG/1.1/DTD/svg11.dtd\">\n<svg ";
-		attribute(s, "width", layout.dimensions.width, "px");
-		attribute(s, "height", layout.dimensions.height, "px");
-		attribute(s, "xmlns", "http://www.w3.org/2000/svg");
-		attribute(s, "version", "1.1");
-		s += ">\n";
-		s += body_nodes_str;
-		s += elemEnd("svg");
-	}
-	bool save() const
-	{
-		FILE* f = fopen(file_name.c_str(), "wb");
-		if (!f) {
-			return false;
-		}
-		string s;
-		toString(s);
-		fwrite(s.c_str(), 1, s.size(), f);
-		fclose(f);
-		return true;
+		if (pending.size() >= BlockPool::block_size)
+			flush();
 	}
+	// Moves pending, and any run being merged, into body whatever its size.
+	void flush();
+	// Turns everything written so far into a read-only frame that clones
+	// share instead of copying.  The frame was rendered for this layout, so
+	// it, and the preamble cached with it, stay as they are afterwards.
+	void freeze();
+	// A new document with the same layout and content.  Frozen content is
+	// shared, whatever was added since the last freeze() is copied.
+	Document clone(const string& file_name) const;
+	void toString(string& s) const;
+	// Writes the blocks straight to the file, gathered with writev where the
+	// platform has it.
+	bool save() const;
+	// Like save(), but first compares the existing file with the output and
+	// leaves it alone, modification time included, if they're identical.
+	bool saveIfChanged(bool* written = nullptr) const;
+
+	// 64-bit FNV-1a hash of the output, kept up to date as shapes are added
+	// so that it costs no extra pass over the body.
+	uint64_t hash() const;
+	// Size of the output in bytes.
+	size_t size() const;
 
 	string file_name;
 	Layout layout;
-	string body_nodes_str;
+	// Serialized shapes: frozen frames first, then full blocks in body and
+	// the most recent shapes in pending.
+	vector<std::shared_ptr<const OutputBuffer>> frames;
+	OutputBuffer body;
+	string pending;
+	// Writes each run of consecutive rectangles, circles and ellipses that
+	// share a style as one <path>, one subpath per shape, instead of one
+	// element each.  The result looks the same unless shapes in a run
+	// overlap and are stroked: the path paints all fills before all strokes.
+	// Path data is split into a new path about every BlockPool::block_size
+	// bytes.
+	bool merge_shapes;
+
+private:
+	static const uint64_t hash_seed = 14695981039346656037ULL;
+
+	std::shared_ptr<const string> preamble;
+	// Hash of frames and body; pending is added on demand.
+	uint64_t digest;
+
+	// The run being merged: its first shape, kept to be written as it is if
+	// nothing joins it, and the path data of all of them.
+	ShapeList run;
+	unsigned run_length;
+	const Style* run_style;
+	string run_path;
+	// Device-space start of the last subpath, where its closing z leaves
+	// the current point.
+	Point run_start;
+	// Arc commands of the last circle or ellipse and the radii they are for.
+	string run_arcs;
+	Point run_radii;
+
+	template <typename T>
+	void extendRun(const T& shape);
+	// Writes out the run being merged, if there is one.
+	void endRun()
+	{
+		if (run_length)
+			writeRun();
+	}
+	void writeRun();
+	void runToString(string& s) const;
+
+	void gather(vector<OutputBuffer::Block>& parts, const string& head, const string& tail) const;
+	void prologue(string& s) const;
+	void epilogue(string& s) const;
+};
+
+// The same scene written to several files, each with its own Layout (say a
+// thumbnail, the default size and a print size).  Every shape is visited once
+// and emitted into all outputs while its geometry is at hand, instead of
+// building one Document per size and adding every shape to each.
+struct MultiDocument
+{
+	MultiDocument& add(const string& file_name, const Layout& layout);
+
+	MultiDocument& operator << (const Shape& shape);
+	// Merged into runs in documents that set merge_shapes.
+	MultiDocument& operator << (const Circle& circle);
+	MultiDocument& operator << (const Elipse& elipse);
+	MultiDocument& operator << (const Rectangle& rectangle);
+	MultiDocument& operator << (const ShapeList& shapes);
+	// Defined in scene_cache.cpp.
+	MultiDocument& operator << (const MappedScene& scene);
+	// Returns false if any output couldn't be written.
+	bool save() const;
+
+	vector<Document> documents;
 };
 
 } // namespace svg
+